@@ -3,6 +3,7 @@
 #include "controlleruser.h"
 
 #include <stdint.h>
+#include <algorithm>
 #include <utility>
 
 void Controller::swap()
@@ -33,33 +34,112 @@ Controller::Controller()
   registerTickType(DEFAULT_TICK);
 }
 
+/*
+ * Users are ticked in the order they are registered, and not by address,
+ * so that a run repeats exactly from the same inputs. Every user knows its
+ * place in the order, so registering and unregistering take constant time
+ * however many users there are: an unregistered user's place is taken by
+ * the last one. Only the order of the users it is given is changed by
+ * reorderUsers().
+ */
 void Controller::registerUser(ControllerUser *user)
 {
-  m_users.insert(user);
+  if (user->m_controllerIndex < 0)
+  {
+    user->m_controllerIndex = m_users.size();
+    m_users.push_back(user);
+  }
 }
 
 void Controller::unregisterUser(ControllerUser *user)
 {
-  m_users.erase(user);
+  int index = user->m_controllerIndex;
+  if (index < 0 || index >= static_cast<int>(m_users.size()) || m_users[index] != user)
+  {
+    return;
+  }
+  m_users[index] = m_users.back();
+  m_users[index]->m_controllerIndex = index;
+  m_users.pop_back();
+  user->m_controllerIndex = -1;
 }
 
+/*
+ * Tick the given users in the given order, in the places they already
+ * have between the others, which keep theirs. For users whose order does
+ * not matter to each other, such as the traffic signals, so that they may
+ * be ticked in the order of the memory they work on.
+ */
+void Controller::reorderUsers(const std::vector<ControllerUser*> & users)
+{
+  std::vector<int> indexes;
+  std::vector<ControllerUser*> registered;
+  for (std::vector<ControllerUser*>::const_iterator it = users.cbegin(); it != users.cend(); ++it)
+  {
+    int index = (*it)->m_controllerIndex;
+    if (index >= 0 && index < static_cast<int>(m_users.size()) && m_users[index] == *it)
+    {
+      indexes.push_back(index);
+      registered.push_back(*it);
+    }
+  }
+  std::sort(indexes.begin(), indexes.end());
+  indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+  if (indexes.size() != registered.size())
+  {
+    return; // A user was given twice
+  }
+
+  for (size_t i = 0; i < indexes.size(); ++i)
+  {
+    m_users[indexes[i]] = registered[i];
+    registered[i]->m_controllerIndex = indexes[i];
+  }
+}
+
+void Controller::registerPipeline(TickPipelineBase *pipeline)
+{
+  if (std::find(m_pipelines.begin(), m_pipelines.end(), pipeline) == m_pipelines.end())
+  {
+    m_pipelines.push_back(pipeline);
+  }
+}
+
+void Controller::unregisterPipeline(TickPipelineBase *pipeline)
+{
+  m_pipelines.erase(std::remove(m_pipelines.begin(), m_pipelines.end(), pipeline),
+                    m_pipelines.end());
+}
+
+// Tick types are ticked in the order they are registered, so a tick type
+// can be placed between two others regardless of its number.
 void Controller::registerTickType(int32_t tickType)
 {
-  m_tickTypes.insert(tickType);
+  if (std::find(m_tickTypes.begin(), m_tickTypes.end(), tickType) == m_tickTypes.end())
+  {
+    m_tickTypes.push_back(tickType);
+  }
 }
 
 void Controller::unregisterTickType(int32_t tickType)
 {
-  m_tickTypes.erase(tickType);
+  m_tickTypes.erase(std::remove(m_tickTypes.begin(), m_tickTypes.end(), tickType),
+                    m_tickTypes.end());
 }
 
 void Controller::tick()
 {
-  // For all tick steps, tick all users.
-  for (std::set<int32_t>::iterator it_tickType = m_tickTypes.begin();
+  // For all tick steps, tick all pipelines, then all individual users.
+  for (std::vector<int32_t>::iterator it_tickType = m_tickTypes.begin();
       it_tickType != m_tickTypes.end(); ++it_tickType)
   {
-    for (std::set<ControllerUser*>::iterator it_user = m_users.begin();
+    for (std::vector<TickPipelineBase*>::iterator it_pipeline = m_pipelines.begin();
+        it_pipeline != m_pipelines.end(); ++it_pipeline)
+    {
+      (*it_pipeline)->tick(*it_tickType);
+    }
+
+    for (std::vector<ControllerUser*>::iterator it_user = m_users.begin();
         it_user != m_users.end(); ++it_user)
     {
       (*it_user)->tick(*it_tickType);
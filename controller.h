@@ -1,9 +1,10 @@
 #pragma once
 
 #include "controlleruser.h"
+#include "tickpipeline.h"
 
 #include <stdint.h>
-#include <set>
+#include <vector>
 
 const int32_t DEFAULT_TICK = 0;
 
@@ -15,8 +16,9 @@ class Controller
     int m_NOW;
     int m_THEN;
 
-    std::set<ControllerUser*> m_users;
-    std::set<int32_t> m_tickTypes;
+    std::vector<ControllerUser*> m_users; // Ticked in this order
+    std::vector<TickPipelineBase*> m_pipelines;
+    std::vector<int32_t> m_tickTypes; // Ticked in registration order
 
     void swap();
 
@@ -28,6 +30,9 @@ class Controller
 
     void registerUser(ControllerUser *user);
     void unregisterUser(ControllerUser *user);
+    void reorderUsers(const std::vector<ControllerUser*> & users);
+    void registerPipeline(TickPipelineBase *pipeline);
+    void unregisterPipeline(TickPipelineBase *pipeline);
     void registerTickType(int32_t tickType);
     void unregisterTickType(int32_t tickType);
 
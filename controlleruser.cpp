@@ -2,9 +2,15 @@
 #include "controlleruser.h"
 #include "controller.h"
 
-ControllerUser::ControllerUser(Controller *controller)
+// Users ticked through a TickPipeline pass registerWithController = false,
+// as they must not also be ticked individually.
+ControllerUser::ControllerUser(Controller *controller, bool registerWithController)
 {
   this->controller = controller;
-  controller->registerUser(this);
+  m_controllerIndex = -1;
+  if (registerWithController)
+  {
+    controller->registerUser(this);
+  }
 }
 
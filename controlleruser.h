@@ -6,9 +6,13 @@ class Controller;
 
 class ControllerUser
 {
+  private:
+    friend class Controller;
+    int m_controllerIndex; // Place among the controller's users, or -1
+
   public:
     Controller *controller;
-    ControllerUser(Controller *controller);
+    ControllerUser(Controller *controller, bool registerWithController = true);
     virtual ~ControllerUser() {};
     virtual void tick(int tickType) = 0;
 };
@@ -0,0 +1,47 @@
+#include "line.h"
+
+#include <algorithm>
+
+/*
+ * Same-line car-following for a whole line at once
+ *
+ * For every packet but the front one, decide the speed action against the
+ * packet ahead of it in the same line, exactly as forwardGetSpeedAction()
+ * does. Packets that would be allowed to increase their speed, and whose
+ * search point reaches beyond the end of the line, must still run the full
+ * forward search; they are flagged in needsSearch.
+ *
+ * The loop reads plain arrays and has no division and no branch, so GCC
+ * vectorises it at -O3 for AVX2 (TRAFIKK_NATIVE on such a host). It lives
+ * in a file of its own so that the kernelvectorised test can compile it
+ * alone and look for that. trafikkcheck checks its results against
+ * forwardGetSpeedAction().
+ */
+void followLeaderKernel(const int           * positions,
+                        const int           * speeds,
+                        const int           * lengths,
+                        const unsigned char * vehicleClasses,
+                        int                   count,
+                        int                   lineLength,
+                        unsigned char       * actions,
+                        unsigned char       * needsSearch)
+{
+  for (int i = 1; i < count; ++i)
+  {
+    const VehicleClass & vehicleClass = VEHICLE_CLASSES[vehicleClasses[i]];
+    const VehicleClass & leaderClass = VEHICLE_CLASSES[vehicleClasses[i - 1]];
+    int speed = speeds[i];
+    int leaderSpeed = speeds[i - 1];
+    int brakePoint = positions[i] + brakeLength(speed, vehicleClass.brakeDivider);
+    int leaderBrakePoint = positions[i - 1] + brakeLength(leaderSpeed, leaderClass.brakeDivider);
+    int leaderMargin = std::max(0, leaderBrakePoint - leaderClass.brakeAcceleration);
+
+    int brake = (brakePoint + speed + lengths[i - 1]) >= leaderBrakePoint;
+    int maintain = (brakePoint + speed + vehicleClass.speedupAcceleration + lengths[i - 1])
+                 >= leaderMargin;
+    int searchBeyondLine = (brakePoint + (2 * speed) + (2 * lengths[i])) > lineLength;
+
+    actions[i] = brake ? BRAKE : (maintain ? MAINTAIN : INCREASE);
+    needsSearch[i] = (maintain == 0) & searchBeyondLine;
+  }
+}
@@ -0,0 +1,319 @@
+#include "journal.h"
+#include "trafficsignal.h"
+
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#include <sstream>
+
+struct JournalCommandInfo
+{
+  const char * name;
+  int lineCount;
+  int valueCount;
+};
+
+static const JournalCommandInfo JOURNAL_COMMANDS[NUMBER_OF_JOURNAL_COMMANDS] =
+{
+  {"addLine", 0, 6},         // Begin and end point
+  {"removeLine", 1, 0},
+  {"splitLine", 1, 1},       // Distance
+  {"connectLines", 2, 0},
+  {"disconnectLines", 2, 0},
+  {"setConflictRule", 2, 1}, // ConflictRule
+  {"setLineClosed", 1, 1},   // 1 for closed
+  {"moveLine", 1, 6},        // Begin and end point
+  {"setPhaseTimes", 0, 4}    // Signal, phase, green time and clearance time
+};
+
+const char JOURNAL_HEADER[] = "# trafikk journal";
+
+JournalRecorder::JournalRecorder(TransportNetwork * transportNetwork)
+  : p_transportNetwork(transportNetwork)
+{
+}
+
+JournalRecorder::~JournalRecorder()
+{
+  close();
+}
+
+// Start a journal of a run of networkFileName seeded with seed
+bool JournalRecorder::open(const std::string & fileName, const std::string & networkFileName,
+                           unsigned int seed)
+{
+  m_file.open(fileName.c_str());
+  if (!m_file)
+  {
+    std::cerr << fileName << ": cannot write journal" << std::endl;
+    return false;
+  }
+  m_file.precision(17);
+  m_file << JOURNAL_HEADER << std::endl
+         << "network " << networkFileName << std::endl
+         << "seed " << seed << std::endl;
+  return true;
+}
+
+// End the journal with the tick and the state it got to
+void JournalRecorder::close()
+{
+  if (!m_file.is_open())
+  {
+    return;
+  }
+  m_file << p_transportNetwork->getTick() << " end "
+         << p_transportNetwork->hashState() << std::endl;
+  m_file.close();
+}
+
+int JournalRecorder::lineIndex(Line * line)
+{
+  const std::vector<Line *> & lines = p_transportNetwork->getLines();
+  std::vector<Line *>::const_iterator it = std::find(lines.cbegin(), lines.cend(), line);
+  return it != lines.cend() ? static_cast<int>(it - lines.cbegin()) : -1;
+}
+
+// Record an edit, before it is made. Every entry is flushed at once, so
+// that the journal survives a crash.
+void JournalRecorder::record(JournalCommand command, Line * line, Line * other,
+                             const std::vector<double> & values)
+{
+  if (!m_file.is_open())
+  {
+    return;
+  }
+  m_file << p_transportNetwork->getTick() << " " << JOURNAL_COMMANDS[command].name;
+  if (JOURNAL_COMMANDS[command].lineCount > 0)
+  {
+    m_file << " " << lineIndex(line);
+  }
+  if (JOURNAL_COMMANDS[command].lineCount > 1)
+  {
+    m_file << " " << lineIndex(other);
+  }
+  for (std::vector<double>::const_iterator it = values.cbegin(); it != values.cend(); ++it)
+  {
+    m_file << " " << *it;
+  }
+  m_file << std::endl;
+}
+
+void JournalRecorder::recordPhaseTimes(TrafficSignal * signal, int phaseIndex, int greenTime,
+                                       int clearanceTime)
+{
+  const std::vector<TrafficSignal *> & signals = p_transportNetwork->getSignals();
+  std::vector<TrafficSignal *>::const_iterator it = std::find(signals.cbegin(), signals.cend(), signal);
+  std::vector<double> values;
+  values.push_back(it != signals.cend() ? it - signals.cbegin() : -1);
+  values.push_back(phaseIndex);
+  values.push_back(greenTime);
+  values.push_back(clearanceTime);
+  record(JOURNAL_SET_PHASE_TIMES, NULL, NULL, values);
+}
+
+// Read a journal; false, with the error reported, if it is not one
+bool Journal::load(const std::string & fileName)
+{
+  seed = 0;
+  entries.clear();
+  hasEnd = false;
+  endTick = 0;
+  endHash = 0;
+
+  std::ifstream file(fileName.c_str());
+  std::string line;
+  if (!std::getline(file, line) || line != JOURNAL_HEADER)
+  {
+    std::cerr << fileName << ": not a journal" << std::endl;
+    return false;
+  }
+
+  int fileLine = 1;
+  while (std::getline(file, line))
+  {
+    ++fileLine;
+    std::istringstream fields(line);
+    std::string first, name;
+    if (!(fields >> first) || first[0] == '#')
+    {
+      continue;
+    }
+    if (first == "network")
+    {
+      std::getline(fields >> std::ws, networkFileName);
+      continue;
+    }
+    if (first == "seed")
+    {
+      fields >> seed;
+      continue;
+    }
+
+    JournalEntry entry;
+    std::istringstream tick(first);
+    bool valid = static_cast<bool>(tick >> entry.tick) && static_cast<bool>(fields >> name);
+    if (valid && name == "end")
+    {
+      hasEnd = static_cast<bool>(fields >> endHash);
+      endTick = entry.tick;
+      continue;
+    }
+
+    int command = 0;
+    while (command < NUMBER_OF_JOURNAL_COMMANDS && name != JOURNAL_COMMANDS[command].name)
+    {
+      ++command;
+    }
+    valid = valid && command < NUMBER_OF_JOURNAL_COMMANDS;
+    if (valid)
+    {
+      entry.command = static_cast<JournalCommand>(command);
+      entry.lines.resize(JOURNAL_COMMANDS[command].lineCount);
+      entry.values.resize(JOURNAL_COMMANDS[command].valueCount);
+      for (size_t i = 0; i < entry.lines.size(); ++i)
+      {
+        valid = valid && (fields >> entry.lines[i]);
+      }
+      for (size_t i = 0; i < entry.values.size(); ++i)
+      {
+        valid = valid && (fields >> entry.values[i]);
+      }
+    }
+    if (!valid)
+    {
+      std::cerr << fileName << ":" << fileLine << ": bad journal entry" << std::endl;
+      return false;
+    }
+    entries.push_back(entry);
+  }
+
+  if (networkFileName.empty())
+  {
+    std::cerr << fileName << ": no network file in journal" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+JournalPlayer::JournalPlayer(Controller * controller, TransportNetwork * transportNetwork,
+                             const Journal & journal)
+  : ControllerUser(controller),
+    p_transportNetwork(transportNetwork),
+    m_journal(journal),
+    m_next(0),
+    m_lastTick(0)
+{
+}
+
+JournalPlayer::~JournalPlayer()
+{
+  controller->unregisterUser(this);
+}
+
+void JournalPlayer::apply(const JournalEntry & entry)
+{
+  const std::vector<Line *> & lines = p_transportNetwork->getLines();
+  std::vector<Line *> entryLines;
+  for (std::vector<int>::const_iterator it = entry.lines.cbegin(); it != entry.lines.cend(); ++it)
+  {
+    if (*it < 0 || *it >= static_cast<int>(lines.size()))
+    {
+      std::cerr << "Journal entry at tick " << entry.tick << " refers to a missing line" << std::endl;
+      return;
+    }
+    entryLines.push_back(lines[*it]);
+  }
+  const std::vector<double> & values = entry.values;
+  Coordinates beginPoint = {0.0f, 0.0f, 0.0f};
+  Coordinates endPoint = {0.0f, 0.0f, 0.0f};
+  if (values.size() == 6)
+  {
+    beginPoint.x = values[0];
+    beginPoint.y = values[1];
+    beginPoint.z = values[2];
+    endPoint.x = values[3];
+    endPoint.y = values[4];
+    endPoint.z = values[5];
+  }
+
+  switch (entry.command)
+  {
+    case JOURNAL_ADD_LINE:
+      p_transportNetwork->addLine(beginPoint, endPoint);
+      break;
+    case JOURNAL_REMOVE_LINE:
+      p_transportNetwork->removeLine(entryLines[0]);
+      break;
+    case JOURNAL_SPLIT_LINE:
+      p_transportNetwork->splitLine(entryLines[0], static_cast<int>(values[0]));
+      break;
+    case JOURNAL_CONNECT_LINES:
+      p_transportNetwork->connectLines(entryLines[0], entryLines[1]);
+      break;
+    case JOURNAL_DISCONNECT_LINES:
+      p_transportNetwork->disconnectLines(entryLines[0], entryLines[1]);
+      break;
+    case JOURNAL_SET_CONFLICT_RULE:
+      p_transportNetwork->setConflictRule(entryLines[0], entryLines[1],
+                                          static_cast<ConflictRule>(static_cast<int>(values[0])));
+      break;
+    case JOURNAL_SET_LINE_CLOSED:
+      p_transportNetwork->setLineClosed(entryLines[0], values[0] != 0.0);
+      break;
+    case JOURNAL_MOVE_LINE:
+      p_transportNetwork->moveLine(entryLines[0], beginPoint, endPoint);
+      break;
+    case JOURNAL_SET_PHASE_TIMES:
+      {
+        const std::vector<TrafficSignal *> & signals = p_transportNetwork->getSignals();
+        int signal = static_cast<int>(values[0]);
+        if (signal >= 0 && signal < static_cast<int>(signals.size()))
+        {
+          signals[signal]->setPhaseTimes(static_cast<int>(values[1]), static_cast<int>(values[2]),
+                                         static_cast<int>(values[3]));
+        }
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// Play the entries of the ticks run so far, up to the last tick to play:
+// either the edits between ticks, or the retimings in tick 1.
+void JournalPlayer::applyEntries(bool phaseTimes)
+{
+  unsigned int tick = std::min(p_transportNetwork->getTick(), m_lastTick);
+  const std::vector<JournalEntry> & entries = m_journal.entries;
+  while (m_next < entries.size() && entries[m_next].tick <= tick
+         && (entries[m_next].command == JOURNAL_SET_PHASE_TIMES) == phaseTimes)
+  {
+    apply(entries[m_next++]);
+  }
+}
+
+/*
+ * Run the network on to tick, as fast as it goes, making the edits of the
+ * journal between the ticks. The edits made before the coming tick are
+ * made too, so the network is as the recording run left it at tick.
+ */
+void JournalPlayer::run(unsigned int tick)
+{
+  m_lastTick = tick;
+  applyEntries(false);
+  while (p_transportNetwork->getTick() < tick)
+  {
+    controller->tick();
+    applyEntries(false);
+  }
+}
+
+// Retime the signals as the SignalOptimiser did in this tick
+void JournalPlayer::tick(int tickType)
+{
+  if (tickType == 1)
+  {
+    applyEntries(true);
+  }
+}
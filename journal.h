@@ -0,0 +1,116 @@
+#pragma once
+
+#include "controller.h"
+#include "controlleruser.h"
+#include "line.h"
+
+#include <stdint.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+class TrafficSignal; // Forward declaration
+
+/*
+ * Input journal, for running a simulation again exactly as it went
+ *
+ * A run is given by its network file, the seed of its random numbers, and
+ * what was done to it on the way: the edits made to the network between
+ * ticks, and the signal retimings of the SignalOptimiser, whose thread
+ * takes its time. Vehicles only come with the lines loaded from the file,
+ * so they follow from the seed. Given these, and users ticked in the order
+ * they registered, every tick repeats exactly.
+ *
+ * The journal is a text file: a header with the network file and the seed,
+ * then one entry per line, starting with the number of the ticks run before
+ * it. Lines are given by their index in TransportNetwork::getLines(), as it
+ * is when the entry is made, and signals by their index in getSignals().
+ * An end entry, written on closing, has the last tick and a hash of the
+ * state there.
+ */
+
+enum JournalCommand
+{
+  JOURNAL_ADD_LINE,
+  JOURNAL_REMOVE_LINE,
+  JOURNAL_SPLIT_LINE,
+  JOURNAL_CONNECT_LINES,
+  JOURNAL_DISCONNECT_LINES,
+  JOURNAL_SET_CONFLICT_RULE,
+  JOURNAL_SET_LINE_CLOSED,
+  JOURNAL_MOVE_LINE,
+  JOURNAL_SET_PHASE_TIMES, // Made during tick 1, not between ticks
+  NUMBER_OF_JOURNAL_COMMANDS
+};
+
+struct JournalEntry
+{
+  unsigned int tick;
+  JournalCommand command;
+  std::vector<int> lines;
+  std::vector<double> values;
+};
+
+// A journal as read from its file
+struct Journal
+{
+  std::string networkFileName;
+  unsigned int seed;
+  std::vector<JournalEntry> entries;
+  bool hasEnd; // Whether the run ended cleanly, with its last tick and state
+  unsigned int endTick;
+  uint64_t endHash;
+
+  bool load(const std::string & fileName);
+};
+
+// Writes a journal as the run goes
+class JournalRecorder
+{
+  private:
+    TransportNetwork * p_transportNetwork;
+    std::ofstream m_file;
+
+    int lineIndex(Line * line);
+
+  public:
+    JournalRecorder(TransportNetwork * transportNetwork);
+    ~JournalRecorder();
+
+    bool open(const std::string & fileName, const std::string & networkFileName,
+              unsigned int seed);
+    void close();
+
+    void record(JournalCommand command, Line * line, Line * other,
+                const std::vector<double> & values);
+    void recordPhaseTimes(TrafficSignal * signal, int phaseIndex, int greenTime,
+                          int clearanceTime);
+};
+
+/*
+ * Plays a journal back into a network loaded from its file with its seed
+ *
+ * Make the player right after loading the network, where the recording run
+ * made its SignalOptimiser, so that it retimes the signals at the same
+ * point of the tick. run() makes the edits between the ticks. Nothing done
+ * after the last tick to play is played.
+ */
+class JournalPlayer : public ControllerUser
+{
+  private:
+    TransportNetwork * p_transportNetwork;
+    const Journal & m_journal;
+    size_t m_next;
+    unsigned int m_lastTick;
+
+    void apply(const JournalEntry & entry);
+    void applyEntries(bool phaseTimes);
+
+  public:
+    JournalPlayer(Controller * controller, TransportNetwork * transportNetwork,
+                  const Journal & journal);
+    ~JournalPlayer();
+
+    void run(unsigned int tick);
+    virtual void tick(int tickType);
+};
@@ -2,10 +2,18 @@
 
 #include "controller.h"
 #include "lockstepvalue.h"
+#include "tripstatistics.h"
 
+#include <stdint.h>
+#include <atomic>
+#include <climits>
 #include <vector>
 #include <map>
+#include <set>
+#include <deque>
 #include <queue>
+#include <string>
+#include <cstddef>
 #include <unordered_map>
 
 const int AVERAGE_ROAD_LENGTH_PER_VEHICLE = 50000;
@@ -18,8 +26,128 @@ const int VEHICLE_WIDTH = 1750;
 const int BRAKE_ACCELERATION = 3500;
 const int SPEEDUP_ACCELERATION = 1500;
 
+const int NO_SPEED_LIMIT = INT_MAX;
+const int MAX_SPEED = 65535; // mm/s, speed limits and turn speeds are capped here
+const int LATERAL_ACCELERATION = 2000; // Comfortable sideways acceleration in turns, mm/s^2
+const int QUEUE_SPEED = 1000; // Packets slower than this are counted as queued, mm/s
+const int MESO_HEADWAY = 2;   // Ticks between packets leaving a mesoscopic line
+
 const int ZOOM_FACTOR = 5000.0f;
 
+/*
+ * Division by a brake acceleration as a multiplication and a shift
+ *
+ * With 2^(shift - 32) < brakeAcceleration <= 2^(shift - 31), and the
+ * multiplier rounded up, the product shifted right is the truncated quotient
+ * of any dividend below 2^31 (Granlund and Montgomery), which is what
+ * brakeLength() needs for speeds up to MAX_SPEED.
+ */
+struct BrakeDivider
+{
+  uint32_t multiplier;
+  int shift;
+};
+
+constexpr int brakeDividerShift(int brakeAcceleration, int bits = 0)
+{
+  return (1LL << bits) >= brakeAcceleration ? 31 + bits : brakeDividerShift(brakeAcceleration, bits + 1);
+}
+
+constexpr BrakeDivider brakeDivider(int brakeAcceleration)
+{
+  return { static_cast<uint32_t>(((1ULL << brakeDividerShift(brakeAcceleration)) + brakeAcceleration - 1)
+                                 / brakeAcceleration),
+           brakeDividerShift(brakeAcceleration) };
+}
+
+/*
+ * Distance needed to brake from speed to a stand-still
+ *
+ * Exact integer equivalent of truncating pow(speed, 2) / (2 * brakeAcceleration)
+ * for |speed| <= MAX_SPEED, where the square fits in 32 bits unsigned. There
+ * is no division and no branch, so the searches can afford it everywhere and
+ * followLeaderKernel() still vectorises.
+ */
+constexpr int brakeLength(int speed, BrakeDivider divider)
+{
+  return static_cast<int>((static_cast<uint64_t>((static_cast<uint32_t>(speed) * static_cast<uint32_t>(speed)) >> 1)
+                           * divider.multiplier) >> divider.shift);
+}
+
+// For brake accelerations known at compile time
+constexpr int brakeLength(int speed, int brakeAcceleration = BRAKE_ACCELERATION)
+{
+  return brakeLength(speed, brakeDivider(brakeAcceleration));
+}
+
+// Add a value to an FNV-1a hash of the simulation state, a field at a time
+inline uint64_t hashStep(uint64_t hash, uint64_t value)
+{
+  return (hash ^ value) * 1099511628211ULL;
+}
+
+/*
+ * Vehicle classes
+ *
+ * Packets refer to their class by index into VEHICLE_CLASSES, and the
+ * searches look up length and accelerations there, so a mixed fleet costs
+ * the same per tick as a uniform one.
+ */
+struct VehicleClass
+{
+  int length;               // mm
+  int width;                // mm
+  int height;               // mm
+  int speedupAcceleration;  // mm/s gained per tick
+  int brakeAcceleration;    // mm/s lost per tick
+  BrakeDivider brakeDivider; // brakeDivider(brakeAcceleration), for brakeLength()
+  int preferredSpeed;       // mm/s, mean of the preferred speed distribution
+  int preferredSpeedSpread; // mm/s, preferred speeds are uniform within +/- this
+  int spawnWeight;          // Relative share of spawned vehicles
+};
+
+enum VehicleClassIndex
+{
+  VEHICLE_CLASS_CAR,
+  VEHICLE_CLASS_BUS,
+  VEHICLE_CLASS_TRUCK,
+  NUMBER_OF_VEHICLE_CLASSES
+};
+
+extern const VehicleClass VEHICLE_CLASSES[NUMBER_OF_VEHICLE_CLASSES];
+
+/*
+ * The vehicles lines start out with when they are built: how many, as a
+ * percent of one per AVERAGE_ROAD_LENGTH_PER_VEHICLE of line, and the
+ * relative shares of the classes, by default their spawnWeight
+ */
+struct TrafficDemand
+{
+  int percent;
+  int classWeights[NUMBER_OF_VEHICLE_CLASSES];
+
+  TrafficDemand();
+};
+
+unsigned char randomVehicleClass(const TrafficDemand & demand);
+
+// Same-line car-following for all the packets of a line, as tick0() does it
+void followLeaderKernel(const int * positions, const int * speeds, const int * lengths,
+                        const unsigned char * vehicleClasses, int count, int lineLength,
+                        unsigned char * actions, unsigned char * needsSearch);
+
+// Packet IDs are handles: the low 32 bits index a packet slot, and the high
+// 32 bits hold the generation of that slot. A slot gets a new generation
+// every time it is reused, so stale IDs (in waitingFor, packetIDsToYieldFor,
+// etc.) never resolve to the packet that took over the slot. Slots are
+// always reused; a generation only comes round again after 2^32 reuses of
+// the same slot.
+typedef uint64_t PacketId;
+const unsigned int PACKET_INDEX_BITS = 32;
+const PacketId PACKET_INDEX_MASK = 0xffffffffULL;
+// No packet, as in blockedBy and waitingFor. Its index is never handed out.
+const PacketId NO_PACKET = UINT64_MAX;
+
 enum SpeedAction
 {
   BRAKE,
@@ -28,19 +156,91 @@ enum SpeedAction
 };
 
 class Line; // Forward declaration
+class LinePipeline; // Forward declaration
+class TrafficSignal; // Forward declaration
+class Road; // Forward declaration
+struct LoopDetector; // Forward declaration
+class JournalRecorder; // Forward declaration
 
 struct SpeedActionInfo
 {
   SpeedAction speedAction; // What speed action to perform.
-  unsigned int blockedBy; // ID of the Transport Network Packet to yield for
+  PacketId blockedBy; // ID of the Transport Network Packet to yield for
   bool physicallyBlocked; // Whether or not blockedBy physically blocks the path
 };
 
+// What a backward search makes of a line, before its inbound lines
+struct BackwardVisit
+{
+  SpeedActionInfo result;
+  bool searchInbound; // Combine the results of the inbound lines into result
+  bool checkBlocker;  // Then check the packet on the line ahead of them
+};
+
 struct Vehicle
 {
   float color[3];
 };
 
+const int ROUTE_LENGTH = 10;
+
+/*
+ * Fixed capacity list of route points
+ *
+ * Stored inline in the packet state, so that copying state from NOW to
+ * THEN every tick never allocates.
+ */
+class Route
+{
+  private:
+    Line * m_points[ROUTE_LENGTH];
+    int m_size;
+
+  public:
+    typedef Line * const * const_iterator;
+
+    Route() : m_size(0) {}
+
+    int size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    bool full() const { return m_size == ROUTE_LENGTH; }
+    Line * front() const { return m_points[0]; }
+    Line * back() const { return m_points[m_size - 1]; }
+    const_iterator cbegin() const { return m_points; }
+    const_iterator cend() const { return m_points + m_size; }
+
+    void push_back(Line * line)
+    {
+      if (m_size < ROUTE_LENGTH)
+      {
+        m_points[m_size++] = line;
+      }
+    }
+
+    void pop_front()
+    {
+      for (int i = 1; i < m_size; ++i)
+      {
+        m_points[i - 1] = m_points[i];
+      }
+      --m_size;
+    }
+
+    // Drop line and every point after it; false if line is not on the route
+    bool truncateAt(Line * line)
+    {
+      for (int i = 0; i < m_size; ++i)
+      {
+        if (m_points[i] == line)
+        {
+          m_size = i;
+          return true;
+        }
+      }
+      return false;
+    }
+};
+
 struct TransportNetworkPacketMutableData
 {
   int speed;
@@ -48,12 +248,12 @@ struct TransportNetworkPacketMutableData
   Line * line;
 
   SpeedAction speedAction;
-  unsigned int waitingFor;
+  PacketId waitingFor;
   int waitedTime;
   bool physicallyBlocked;
 
-  std::set<unsigned int> packetIDsToYieldFor;
-  std::deque<Line *> route;
+  std::set<PacketId> packetIDsToYieldFor;
+  Route route;
 
   void addRoutePoint(Line * line)
   {
@@ -72,30 +272,99 @@ struct TransportNetworkPacketMutableData
 class TransportNetworkPacket
 {
   public:
-    unsigned int id;
-    Vehicle * vehicle;
+    PacketId id;
+    Vehicle * vehicle; // Owned by the TransportNetwork once the packet is added
+    unsigned char vehicleClass; // Index into VEHICLE_CLASSES
     int length;
     int preferredSpeed;
 
+    // Trip so far, written only by the line ticking the packet
+    unsigned int spawnTick;
+    int delay; // ms behind free flow
+    int stops;
+
     LockStepValue<TransportNetworkPacketMutableData> mutableData;
 
     TransportNetworkPacket(Controller * controller);
 };
 
-class TransportNetwork
+struct Coordinates; // Forward declaration
+struct NetworkTopology; // Forward declaration
+
+// How a line's packets treat the traffic of another line where they meet
+enum ConflictRule
+{
+  NO_CONFLICT_RULE,
+  MERGE_WITH, // Cooperating line
+  YIELD_TO    // Interfering line
+};
+
+class TransportNetwork : public ControllerUser
 {
   private:
     Controller * p_controller;
     std::vector<Line *> m_lines;
-    std::unordered_map<unsigned int, TransportNetworkPacket> m_packets;
+    std::vector<std::pair<Line *, size_t> > m_lineArenas; // Lines loaded from file
+    std::vector<Line *> m_addedLines; // Lines added by editing, removed or not
+    LinePipeline * m_linePipeline;
+    std::vector<TrafficSignal *> m_signals;
+    std::vector<Road *> m_roads;
+    std::deque<TransportNetworkPacket> m_packets;
+    std::deque<Vehicle> m_vehicles; // One per packet slot
+    std::vector<uint32_t> m_packetGenerations;
+    std::vector<bool> m_packetAlive;
+    std::vector<unsigned int> m_freePacketIndices;
+    std::vector<PacketId> m_removedPacketIDs;
+    unsigned int m_tick;
+    int m_packetCount;
+    int m_registeredLines;
+    unsigned int m_editCount;
+    TrafficDemand m_demand;
+    JournalRecorder * p_journal;
+    TripStatistics m_tripStatistics;
     unsigned int nextPacketIndex();
+    void releaseRemovedPackets();
+    void rerouteAround(const std::vector<Line *> & starts, Line * avoided);
+    void detachLine(Line * line);
+    Line * makeLine(const Coordinates & beginPoint, const Coordinates & endPoint);
+    void orderSignals(size_t firstSignal, Line * arena, int lineCount);
   public:
     TransportNetwork(Controller * controller);
+    ~TransportNetwork();
+
+    int registerLine(Line * line);
 
-    unsigned int addPacket(TransportNetworkPacket packet, Line * line);
-    TransportNetworkPacket * getPacket(unsigned int packetIndex);
+    PacketId addPacket(TransportNetworkPacket packet, Line * line);
+    void removePacket(PacketId packetId);
+    TransportNetworkPacket * getPacket(PacketId packetId);
+    void finishTrip(PacketId packetId);
+    int getTripTime(PacketId packetId);
+    const TripStatistics & getTripStatistics() const;
+    void resetTripStatistics();
     bool loadLinesFromFile(std::string fileName);
+    void build(const NetworkTopology & topology);
+    int getNumberOfPackets() const;
+    unsigned int getTick() const;
+    uint64_t hashState();
+    void setJournal(JournalRecorder * journal);
+    const std::vector<TrafficSignal *> & getSignals() const;
+    const std::vector<Road *> & getRoads() const;
+    const std::vector<Line *> & getLines() const;
+    unsigned int getEditCount() const;
+    void setDemand(const TrafficDemand & demand);
+    const TrafficDemand & getDemand() const;
+
+    // Editing, between ticks
+    Line * addLine(const Coordinates & beginPoint, const Coordinates & endPoint);
+    void removeLine(Line * line);
+    std::pair<Line *, Line *> splitLine(Line * line, int distance);
+    void connectLines(Line * from, Line * to);
+    void disconnectLines(Line * from, Line * to);
+    void setConflictRule(Line * line, Line * other, ConflictRule rule);
+    void setLineClosed(Line * line, bool closed);
+    bool moveLine(Line * line, const Coordinates & beginPoint, const Coordinates & endPoint);
 
+    virtual void tick(int tickType);
     void draw();
 };
 
@@ -104,27 +373,150 @@ struct Coordinates
   float x, y, z;
 };
 
+int lineLength(const Coordinates & beginPoint, const Coordinates & endPoint);
+
+// A line of a NetworkTopology
+struct LineTopology
+{
+  Coordinates begin, end;
+  int speedLimit; // km/h, 0 for none
+  bool mesoscopic;
+};
+
+// A traffic signal of a NetworkTopology
+struct SignalTopology
+{
+  std::vector<int> phaseTimes; // Green and clearance time per phase
+  std::vector<std::vector<int> > phaseLines; // Line indexes
+};
+
+/*
+ * A network as read from a file, before anything is made of it
+ *
+ * Holds the lines, how they relate, the signals and the roads, all by line
+ * index, and nothing that changes while a network runs. Once loaded it is
+ * only read, so one topology can be built into any number of networks,
+ * also at the same time on different threads.
+ */
+struct NetworkTopology
+{
+  std::vector<LineTopology> lines;
+  std::vector<int> order; // Line indexes, connected lines close together
+  // In, out, merge and yield lines of line i are relations[r] from
+  // relationOffsets[r][i] up to relationOffsets[r][i + 1]
+  std::vector<int> relationOffsets[4];
+  std::vector<int> relations[4];
+  std::vector<SignalTopology> signals;
+  std::vector<std::vector<int> > roads; // Lane line indexes
+
+  bool loadFromFile(std::string fileName);
+};
+
+// Random numbers for the simulation, from a generator of the calling
+// thread, so that simulations on different threads do not disturb each
+// other and repeat with the same seed
+void seedRandom(unsigned int seed);
+int randomBelow(int range); // From 0 to range - 1
+
+struct LineAttributes
+{
+  int speedLimit;   // mm/s, or NO_SPEED_LIMIT
+};
+
+// A packet on a mesoscopic line
+struct MesoPacket
+{
+  PacketId id;
+  int exitTime;         // Line tick from which the packet may leave the line
+  int freeFlowExitTime; // Line tick it would leave at without the queue
+};
+
 class Line : public ControllerUser
 {
   private:
-    LockStepValue<std::vector<unsigned int> > _packets;
+    friend class TransportNetwork;
+    template<class User, class... Phases> friend class TickPipeline;
+    int m_pipelineIndex; // Place in the LinePipeline, or -1
+    int m_networkIndex;  // Place in TransportNetwork::getLines(), or -1
+
+    LockStepValue<std::vector<PacketId> > _packets;
+    LockStepValue<bool> _red; // Set by a TrafficSignal
+    bool m_signalled;
+    unsigned int m_passedPackets; // Packets that have left this line
     std::vector<Line *> m_out;
     std::vector<Line *> m_in;
     std::vector<Line *> m_cooperating;
     std::vector<Line *> m_interfering;
+    // The lines that have this one in m_cooperating or m_interfering, so
+    // that a line can be detached without looking at every other line
+    std::vector<Line *> m_cooperatedBy;
+    std::vector<Line *> m_interferedBy;
+    std::vector<int> m_outTurnSpeeds; // Advisory speed into each of m_out
     int m_length;
-    std::map<Line*, std::vector<unsigned int> > m_packetInboxes;
+    LineAttributes m_attributes;
+    std::map<Line*, std::vector<PacketId> > m_packetInboxes;
     Coordinates m_beginPoint, m_endPoint;
     TransportNetwork * p_transportNetwork;
 
+    int turnSpeed(Line * out);
+    void updateTurnSpeeds();
+
+    // A closed line takes no new packets. m_closedOuts counts the closed
+    // lines in m_out, so that the searches need not look at them.
+    bool m_closed;
+    int m_closedOuts;
+
+    // Scratch space for the same-line car-following kernel in tick0(),
+    // kept between ticks to avoid reallocating.
+    std::vector<int> m_followPositions;
+    std::vector<int> m_followSpeeds;
+    std::vector<int> m_followLengths;
+    std::vector<unsigned char> m_followClasses;
+    std::vector<unsigned char> m_followActions;
+    std::vector<unsigned char> m_followNeedsSearch;
+
+    // Mesoscopic lines keep their packets in a point queue instead of
+    // _packets, and do not move them along the line.
+    bool m_mesoscopic;
+    std::deque<MesoPacket> m_mesoQueue;
+    int m_mesoTime;
+    int m_mesoLastExitTime;
+
+    // Loop detectors on this line, counted in tick0() and tick1()
+    std::vector<LoopDetector *> m_detectors;
+    void detect(int from, int to, int length);
+
+    // Index among the lines of the network, for marking lines in searches
+    int m_searchIndex;
+    BackwardVisit backwardMergeVisit(TransportNetworkPacket * requestingPacket,
+                                     Line * requestingLine, int requestingPacketPosition);
+    SpeedActionInfo backwardMergeBlocker(TransportNetworkPacket * requestingPacket,
+                                         int requestingPacketPosition, SpeedActionInfo result);
+    BackwardVisit backwardYieldVisit(TransportNetworkPacket * requestingPacket,
+                                     Line * requestingLine, int requestingPacketPosition);
+    SpeedActionInfo backwardYieldBlocker(TransportNetworkPacket * requestingPacket,
+                                         int requestingPacketPosition, SpeedActionInfo result);
+    SpeedActionInfo backwardSearch(bool yield, TransportNetworkPacket * requestingPacket,
+                                   Line * requestingLine, int requestingPacketPosition);
+
+    bool hasRoomAtBeginning(int speed);
+    void mesoTick0();
+    void mesoTick1();
+
   public:
-    static int totalNumberOfVehicles;
+    static std::atomic<int> totalNumberOfVehicles;
 
-    Line(Controller *controller, Coordinates* beginPoint = NULL, Coordinates* endPoint = NULL, TransportNetwork * transportNetwork = NULL);
-    Line(Controller *controller, Coordinates beginPoint, Coordinates endPoint, TransportNetwork * transportNetwork = NULL);
+    Line(Controller *controller, Coordinates* beginPoint = NULL, Coordinates* endPoint = NULL, TransportNetwork * transportNetwork = NULL, bool addVehicles = true);
+    Line(Controller *controller, Coordinates beginPoint, Coordinates endPoint, TransportNetwork * transportNetwork = NULL, bool addVehicles = true);
 
-    void addPacket(unsigned int packetId);
-    bool deliverPacket(Line * senderLine, unsigned int packetId);
+    void addPacket(PacketId packetId);
+    bool deliverPacket(Line * senderLine, PacketId packetId);
+    bool releasePacket(PacketId packetId);
+    bool insertPacket(PacketId packetId);
+    const std::vector<PacketId> & getPackets();
+    void collectPacketIds(std::vector<PacketId> & packetIds);
+    void takePackets(Line * from, int begin, int end);
+    void clearPackets();
 
     SpeedActionInfo forwardGetSpeedAction(TransportNetworkPacket  * requestingPacket,
                                           int                       requestingPacketIndex,
@@ -141,10 +533,43 @@ class Line : public ControllerUser
     void addOut(Line * out);
     void addCooperating(Line * cooperating);
     void addInterfering(Line * interfering);
-
-    std::vector<Line *> getOut();
+    void setRelations(const std::vector<Line *> & in,
+                      const std::vector<Line *> & out,
+                      const std::vector<Line *> & cooperating,
+                      const std::vector<Line *> & interfering);
+    void removeIn(Line * in);
+    void removeOut(Line * out);
+    void linkConflicts();
+    void removeCooperating(Line * cooperating);
+    void removeInterfering(Line * interfering);
+
+    const std::vector<Line *> & getIn();
+    const std::vector<Line *> & getOut();
+    const std::vector<Line *> & getCooperating();
+    const std::vector<Line *> & getInterfering();
+    Line * chooseOut();
+    Coordinates getBeginPoint();
+    Coordinates getEndPoint();
+    void setPoints(const Coordinates & beginPoint, const Coordinates & endPoint);
 
     int getLength();
+    int getSpeedLimit();
+    void setSpeedLimit(int speedLimit);
+    int getYieldSearchLength();
+    int getEndSpeed(Line * nextLine);
+    void setSignalled();
+    void setRed(bool red);
+    bool isRed();
+    bool setMesoscopic(bool mesoscopic);
+    bool isMesoscopic();
+    void setClosed(bool closed);
+    bool isClosed();
+    int getQueueLength();
+    int getNumberOfPackets();
+    void addDetector(LoopDetector * detector);
+    void removeDetector(LoopDetector * detector);
+    const std::vector<LoopDetector *> & getDetectors();
+    unsigned int getPassedPackets();
     virtual void tick(int tickType);
     void tick0();
     void tick1();
@@ -154,3 +579,11 @@ class Line : public ControllerUser
     Coordinates coordinatesFromLineDistance(int distance);
 };
 
+// Lines in a TransportNetwork are ticked through this pipeline,
+// rather than individually through Line::tick(int).
+class LinePipeline : public TickPipeline<Line,
+                                         TickPhase<0, Line, &Line::tick0>,
+                                         TickPhase<1, Line, &Line::tick1> >
+{
+};
+
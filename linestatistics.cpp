@@ -0,0 +1,73 @@
+#include "linestatistics.h"
+#include "line.h"
+
+const int SECONDS_PER_HOUR = 3600; // One tick is a second
+
+LineStatistics::LineStatistics(Controller * controller)
+  : ControllerUser(controller)
+{
+}
+
+// Start recording the history of a line, from empty
+void LineStatistics::watch(Line * line)
+{
+  if (m_histories.count(line))
+  {
+    return;
+  }
+  LineHistory & history = m_histories[line];
+  for (int i = 0; i < LINE_HISTORY_LENGTH; ++i)
+  {
+    history.occupancy[i] = 0.0f;
+    history.throughput[i] = 0.0f;
+  }
+  history.next = 0;
+  history.tickCount = 0;
+  history.occupancySum = 0;
+  history.lastPassedPackets = line->getPassedPackets();
+}
+
+void LineStatistics::unwatch(Line * line)
+{
+  m_histories.erase(line);
+}
+
+bool LineStatistics::isWatched(Line * line) const
+{
+  return m_histories.count(line) > 0;
+}
+
+// History of a watched line, or NULL
+const LineHistory * LineStatistics::getHistory(Line * line) const
+{
+  std::map<Line *, LineHistory>::const_iterator it = m_histories.find(line);
+  return it != m_histories.end() ? &it->second : NULL;
+}
+
+void LineStatistics::tick(int tickType)
+{
+  if (tickType != 1 || m_histories.empty())
+  {
+    return;
+  }
+
+  for (std::map<Line *, LineHistory>::iterator it = m_histories.begin();
+      it != m_histories.end(); ++it)
+  {
+    LineHistory & history = it->second;
+    history.occupancySum += it->first->getNumberOfPackets();
+    if (++history.tickCount < LINE_STATISTICS_INTERVAL)
+    {
+      continue;
+    }
+
+    unsigned int passed = it->first->getPassedPackets();
+    history.occupancy[history.next] = static_cast<float>(history.occupancySum) / history.tickCount;
+    history.throughput[history.next] = static_cast<float>(passed - history.lastPassedPackets)
+                                       * SECONDS_PER_HOUR / history.tickCount;
+    history.next = (history.next + 1) % LINE_HISTORY_LENGTH;
+    history.tickCount = 0;
+    history.occupancySum = 0;
+    history.lastPassedPackets = passed;
+  }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "controller.h"
+#include "controlleruser.h"
+
+#include <map>
+
+class Line; // Forward declaration
+
+const int LINE_STATISTICS_INTERVAL = 10; // Ticks per sample
+const int LINE_HISTORY_LENGTH = 120;     // Samples kept per line
+
+/*
+ * Recent samples of a line, oldest first from next, as ImGui::PlotLines
+ * takes them
+ */
+struct LineHistory
+{
+  float occupancy[LINE_HISTORY_LENGTH];  // Average packets on the line
+  float throughput[LINE_HISTORY_LENGTH]; // Packets leaving the line, per hour
+  int next;                              // Where the next sample goes
+
+  // Sums for the sample being taken
+  int tickCount;
+  int occupancySum;
+  unsigned int lastPassedPackets;
+};
+
+/*
+ * Occupancy and throughput history of a few watched lines
+ *
+ * Reads the counts every line keeps anyway in tick 1, after the lines are
+ * done with it, so watching a line costs the same however many packets
+ * are on it, and nothing at all for the lines not watched.
+ */
+class LineStatistics : public ControllerUser
+{
+  private:
+    std::map<Line *, LineHistory> m_histories;
+
+  public:
+    LineStatistics(Controller * controller);
+
+    void watch(Line * line);
+    void unwatch(Line * line);
+    bool isWatched(Line * line) const;
+    const LineHistory * getHistory(Line * line) const;
+
+    virtual void tick(int tickType);
+};
@@ -27,8 +27,14 @@
 #include "startup_sound.h"
 
 #include "line.h"
+#include "linestatistics.h"
+#include "networkeditor.h"
+#include "signaloptimiser.h"
+#include "trafficstatistics.h"
+#include "road.h"
 #include "controller.h"
 #include "controlleruser.h"
+#include "journal.h"
 #include "lockstepvalue.h"
 
 const int SAFE_DISTANCE = 500;
@@ -370,8 +376,48 @@ std::vector<Line*> loadTestLines(Controller &controller, std::string fileName)
 }
 
 
-int main()
+/*
+ * trafikk [--record journal | --replay journal [tick]]
+ *
+ * A run is recorded to trafikk.journal, or the file given, unless another
+ * one is replayed. A replay runs the recorded run to tick, by default to
+ * its end, and hands it over paused, to be looked at and run on from there
+ * without the SignalOptimiser.
+ */
+int main(int argc, char * argv[])
 {
+  std::string recordFileName = "trafikk.journal";
+  std::string replayFileName;
+  long replayTick = -1;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string argument = argv[i];
+    if (argument == "--record" && i + 1 < argc)
+    {
+      recordFileName = argv[++i];
+    }
+    else if (argument == "--replay" && i + 1 < argc)
+    {
+      replayFileName = argv[++i];
+      if (i + 1 < argc && argv[i + 1][0] != '-')
+      {
+        replayTick = std::strtol(argv[++i], NULL, 10);
+      }
+    }
+    else
+    {
+      std::cerr << "Usage: " << argv[0]
+                << " [--record journal | --replay journal [tick]]" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  Journal journal;
+  if (!replayFileName.empty() && !journal.load(replayFileName))
+  {
+    return EXIT_FAILURE;
+  }
+
   sf::ContextSettings contextSettings;
   contextSettings.depthBits = 24;
   sf::RenderWindow window(sf::VideoMode(1024, 768),
@@ -409,6 +455,8 @@ int main()
   
   std::cout << "Hello, world!" << std::endl;
   std::srand(std::time(NULL));
+  unsigned int seed = replayFileName.empty() ? std::time(NULL) : journal.seed;
+  seedRandom(seed);
 
   playStartupSound();
  
@@ -442,12 +490,48 @@ int main()
   // Controller for ticking and lockstep values
   Controller controller;
   controller.registerTickType(0);
+  controller.registerTickType(LANE_CHANGE_TICK);
   controller.registerTickType(1);
 
 
   // Make a transport network
+  std::string networkFileName = replayFileName.empty() ? "../testbane.txt"
+                                                      : journal.networkFileName;
   TransportNetwork transportNetwork(&controller);
-  transportNetwork.loadLinesFromFile("../testbane.txt");
+  transportNetwork.loadLinesFromFile(networkFileName);
+
+  // Retime the network's traffic signals to their queues. A replay has
+  // the recorded retimings instead, so its optimiser is given no signals.
+  SignalOptimiser signalOptimiser(&controller, &transportNetwork, replayFileName.empty()
+                                  ? transportNetwork.getSignals() : std::vector<TrafficSignal *>());
+
+  // Record the run, or replay a recorded one up to where it is handed over
+  JournalRecorder journalRecorder(&transportNetwork);
+  JournalPlayer journalPlayer(&controller, &transportNetwork, journal);
+  bool paused = false;
+  if (replayFileName.empty())
+  {
+    if (journalRecorder.open(recordFileName, networkFileName, seed))
+    {
+      transportNetwork.setJournal(&journalRecorder);
+      signalOptimiser.setJournal(&journalRecorder);
+    }
+  }
+  else
+  {
+    unsigned int target = replayTick >= 0 ? static_cast<unsigned int>(replayTick)
+                        : journal.hasEnd ? journal.endTick
+                        : journal.entries.empty() ? 0 : journal.entries.back().tick;
+    journalPlayer.run(target);
+    std::cout << "Replayed " << replayFileName << " to tick " << transportNetwork.getTick()
+              << std::endl;
+    paused = true;
+  }
+
+  // Inspect and edit the network with the mouse
+  LineStatistics lineStatistics(&controller);
+  TrafficStatistics trafficStatistics(&controller);
+  NetworkEditor networkEditor(&transportNetwork, &lineStatistics, &trafficStatistics);
 
   // Make some lines
 //  const bool ONE_WAY_LINES = true;
@@ -481,6 +565,8 @@ int main()
 
   sf::Clock deltaClock;
   sf::Clock fpsClock;
+  sf::Clock tickClock;
+  float tickMilliseconds = 0.0f;
 
   // Main loop
   std::cout << "Entering main loop..." << std::endl;
@@ -497,6 +583,21 @@ int main()
         case sf::Event::Closed:
           running = false;
           break;
+        case sf::Event::MouseButtonPressed:
+          if (event.mouseButton.button == sf::Mouse::Left && !ImGui::GetIO().WantCaptureMouse)
+          {
+            networkEditor.mousePressed(event.mouseButton.x, event.mouseButton.y);
+          }
+          break;
+        case sf::Event::MouseMoved:
+          networkEditor.mouseMoved(event.mouseMove.x, event.mouseMove.y);
+          break;
+        case sf::Event::MouseButtonReleased:
+          if (event.mouseButton.button == sf::Mouse::Left)
+          {
+            networkEditor.mouseReleased();
+          }
+          break;
         default:
           break;
       }
@@ -537,6 +638,7 @@ int main()
 
     // Draw the transportNetwork
     transportNetwork.draw();
+    networkEditor.draw();
 
     // Prepare for drawing through SFML
     unbindModernGL();
@@ -549,15 +651,57 @@ int main()
     char fps_str[30];
     snprintf( fps_str, 30, "%5.1f FPS", fps);
     char vehicle_str[30];
-    snprintf( vehicle_str, 30, "%i vehicles", Line::totalNumberOfVehicles);
+    snprintf( vehicle_str, 30, "%i vehicles", transportNetwork.getNumberOfPackets());
+    char tick_str[30];
+    snprintf( tick_str, 30, "%6.3f ms/tick", tickMilliseconds);
+    char signal_str[50];
+    int throughput = signalOptimiser.getThroughput();
+    int baselineThroughput = signalOptimiser.getBaselineThroughput();
+    float throughputGain = baselineThroughput > 0
+      ? 100.0f * (throughput - baselineThroughput) / baselineThroughput : 0.0f;
+    snprintf( signal_str, 50, "%i vehicles/h at signals (%+.0f%%)",
+        throughput * 3600 / SIGNAL_OPTIMISER_INTERVAL, throughputGain);
 
     ImGui::Begin("Diagnostics");
     ImGui::Text(fps_str);
     ImGui::Text(vehicle_str);
+    ImGui::Text(tick_str);
+    ImGui::Text("Tick %u", transportNetwork.getTick());
+    ImGui::Checkbox("Paused", &paused);
+    bool step = false;
+    if (paused)
+    {
+      ImGui::SameLine();
+      step = ImGui::Button("Step");
+    }
+    if (!transportNetwork.getSignals().empty())
+    {
+      ImGui::Text(signal_str);
+    }
+    const TripStatistics & trips = transportNetwork.getTripStatistics();
+    if (trips.getTrips() > 0 && ImGui::TreeNode("Trips", "%llu trips completed",
+                                                static_cast<unsigned long long>(trips.getTrips())))
+    {
+      ImGui::Text("              p50    p90    p99");
+      ImGui::Text("Trip time %6.0f %6.0f %6.0f s", trips.tripTime.getQuantile(0.5),
+                  trips.tripTime.getQuantile(0.9), trips.tripTime.getQuantile(0.99));
+      ImGui::Text("Delay     %6.0f %6.0f %6.0f s", trips.delay.getQuantile(0.5),
+                  trips.delay.getQuantile(0.9), trips.delay.getQuantile(0.99));
+      ImGui::Text("Stops     %6.0f %6.0f %6.0f", trips.stops.getQuantile(0.5),
+                  trips.stops.getQuantile(0.9), trips.stops.getQuantile(0.99));
+      ImGui::TreePop();
+    }
     ImGui::End();
 
+    networkEditor.drawWindow();
+
 //    std::cout << "\t-\tTICK\t-\t" << std::endl;
-    controller.tick();
+    if (!paused || step)
+    {
+      tickClock.restart();
+      controller.tick();
+      tickMilliseconds = tickClock.getElapsedTime().asMicroseconds() / 1000.0f;
+    }
 
     ImGui::SFML::Render(window);
 
@@ -567,6 +711,8 @@ int main()
   }
 
   ImGui::SFML::Shutdown();
+  journalRecorder.close();
+  transportNetwork.getTripStatistics().writeSummary(std::cout);
   return 0;
 }
 
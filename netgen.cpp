@@ -0,0 +1,144 @@
+#include <iostream>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "networkgenerator.h"
+
+struct NamedOption
+{
+  const char * name;
+  int GeneratorOptions::* value;
+  int minimum; // Sizes must be positive; 0 turns the intervals and counts off
+};
+
+static const NamedOption NAMED_OPTIONS[] = {
+  {"spacing", &GeneratorOptions::spacing, 1},
+  {"arterials", &GeneratorOptions::arterialInterval, 0},
+  {"signals", &GeneratorOptions::signalTime, 0},
+  {"columns", &GeneratorOptions::columns, 1},
+  {"rows", &GeneratorOptions::rows, 1},
+  {"jitter", &GeneratorOptions::jitter, 0},
+  {"segments", &GeneratorOptions::segments, 1},
+  {"spokes", &GeneratorOptions::spokeInterval, 0},
+  {"interchanges", &GeneratorOptions::interchanges, 0},
+  {"lanes", &GeneratorOptions::lanes, 1},
+  {"ramps", &GeneratorOptions::rampInterval, 1},
+  {"lines", &GeneratorOptions::lines, 1}
+};
+const int NAMED_OPTION_COUNT = sizeof(NAMED_OPTIONS) / sizeof(NAMED_OPTIONS[0]);
+
+static void printUsage(const char * program)
+{
+  std::cerr << "Usage: " << program << " grid|ring|corridor|planar output.txt [name=value ...]" << std::endl
+            << "Options: seed";
+  for (int i = 0; i < NAMED_OPTION_COUNT; ++i)
+  {
+    std::cerr << ", " << NAMED_OPTIONS[i].name;
+  }
+  std::cerr << std::endl;
+}
+
+// Set an option from name=value; false if it is not one, or out of range
+static bool setOption(GeneratorOptions & options, const char * argument)
+{
+  const char * equals = strchr(argument, '=');
+  if (equals == NULL || equals[1] == '\0')
+  {
+    return false;
+  }
+  std::string name(argument, equals - argument);
+  char * end;
+  long value = strtol(equals + 1, &end, 10);
+  if (*end != '\0' || value < 0)
+  {
+    return false;
+  }
+
+  if (name == "seed")
+  {
+    options.seed = static_cast<uint32_t>(value);
+    return true;
+  }
+  for (int i = 0; i < NAMED_OPTION_COUNT; ++i)
+  {
+    if (name == NAMED_OPTIONS[i].name)
+    {
+      if (value < NAMED_OPTIONS[i].minimum || value > INT_MAX)
+      {
+        return false;
+      }
+      options.*NAMED_OPTIONS[i].value = static_cast<int>(value);
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Generate a synthetic network file
+ *
+ * netgen grid|ring|corridor|planar output.txt [name=value ...]
+ */
+int main(int argc, char * argv[])
+{
+  if (argc < 3)
+  {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  GeneratorOptions options;
+  std::string origin = "Generated by netgen";
+  for (int i = 1; i < argc; ++i)
+  {
+    if (i >= 3 && !setOption(options, argv[i]))
+    {
+      std::cerr << "Unknown or out of range option " << argv[i] << std::endl;
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    if (i != 2)
+    {
+      origin += std::string(" ") + argv[i];
+    }
+  }
+
+  NetworkGraph graph;
+  std::string type = argv[1];
+  if (type == "grid")
+  {
+    generateGrid(graph, options);
+  }
+  else if (type == "ring")
+  {
+    generateRing(graph, options);
+  }
+  else if (type == "corridor")
+  {
+    generateCorridor(graph, options);
+  }
+  else if (type == "planar")
+  {
+    generatePlanar(graph, options);
+  }
+  else
+  {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  NetworkGraphStatistics statistics;
+  if (!graph.write(argv[2], origin, statistics))
+  {
+    return EXIT_FAILURE;
+  }
+
+  std::cout << graph.getNodeCount() << " nodes, "
+            << statistics.lines << " lines, "
+            << statistics.merges << " merges, "
+            << statistics.yields << " yields" << std::endl;
+  return EXIT_SUCCESS;
+}
+
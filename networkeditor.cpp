@@ -0,0 +1,594 @@
+#include "networkeditor.h"
+#include "linestatistics.h"
+#include "trafficstatistics.h"
+
+#include "imgui.h"
+
+#include <GL/glew.h>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <utility>
+
+const float PICK_DISTANCE = 0.3f; // Network file units from the mouse
+
+static const char * const VEHICLE_CLASS_NAMES[NUMBER_OF_VEHICLE_CLASSES] = {"car", "bus", "truck"};
+static const char * const SPEED_ACTION_NAMES[] = {"brake", "maintain", "increase"};
+
+static float groundDistance(const Coordinates & a, const Coordinates & b)
+{
+  return hypot(a.x - b.x, a.y - b.y);
+}
+
+NetworkEditor::NetworkEditor(TransportNetwork * transportNetwork, LineStatistics * statistics,
+                             TrafficStatistics * trafficStatistics)
+  : p_transportNetwork(transportNetwork),
+    p_statistics(statistics),
+    p_trafficStatistics(trafficStatistics),
+    m_selectedLine(NULL),
+    m_selectedPacket(NO_PACKET),
+    m_dragging(false),
+    m_hasView(false)
+{
+  rebuildIndex();
+}
+
+// Index the network's lines again, as after edits made elsewhere
+void NetworkEditor::rebuildIndex()
+{
+  m_index.build(p_transportNetwork->getLines());
+}
+
+// Where the ray through a window pixel meets the ground, z = 0
+bool NetworkEditor::screenToGround(int x, int y, Coordinates & point)
+{
+  if (!m_hasView || m_viewport[2] <= 0 || m_viewport[3] <= 0)
+  {
+    return false;
+  }
+
+  glm::mat4 unproject = glm::inverse(glm::make_mat4(m_projection) * glm::make_mat4(m_modelview));
+  float deviceX = 2.0f * (x - m_viewport[0]) / m_viewport[2] - 1.0f;
+  float deviceY = 1.0f - 2.0f * (y - m_viewport[1]) / m_viewport[3]; // Window y is downwards
+  glm::vec4 nearPoint = unproject * glm::vec4(deviceX, deviceY, -1.0f, 1.0f);
+  glm::vec4 farPoint = unproject * glm::vec4(deviceX, deviceY, 1.0f, 1.0f);
+  nearPoint /= nearPoint.w;
+  farPoint /= farPoint.w;
+
+  float rise = farPoint.z - nearPoint.z;
+  if (fabs(rise) < 1e-6f)
+  {
+    return false;
+  }
+  float t = -nearPoint.z / rise;
+  if (t < 0.0f || t > 1.0f)
+  {
+    return false;
+  }
+  point.x = nearPoint.x + t * (farPoint.x - nearPoint.x);
+  point.y = nearPoint.y + t * (farPoint.y - nearPoint.y);
+  point.z = 0.0f;
+  return true;
+}
+
+// The packet on line nearest to fraction of the way along it, within PICK_DISTANCE
+PacketId NetworkEditor::findPacket(Line * line, float fraction)
+{
+  int position = fraction * line->getLength();
+  const int PICK_LENGTH = PICK_DISTANCE * ZOOM_FACTOR;
+  PacketId nearest = NO_PACKET;
+  int nearestDistance = INT_MAX;
+
+  const std::vector<PacketId> & packets = line->getPackets();
+  for (std::vector<PacketId>::const_iterator it = packets.cbegin(); it != packets.cend(); ++it)
+  {
+    TransportNetworkPacket * packet = p_transportNetwork->getPacket(*it);
+    if (packet == NULL)
+    {
+      continue;
+    }
+    int distance = abs(packet->mutableData.NOW().positionAtLine - position);
+    if (distance <= packet->length / 2 + PICK_LENGTH && distance < nearestDistance)
+    {
+      nearest = *it;
+      nearestDistance = distance;
+    }
+  }
+  return nearest;
+}
+
+// Add the beginning or end of line to the dragged junction
+void NetworkEditor::addDraggedEnd(Line * line, bool begin)
+{
+  std::vector<DraggedLine>::iterator it = m_draggedLines.begin();
+  while (it != m_draggedLines.end() && it->line != line)
+  {
+    ++it;
+  }
+  if (it == m_draggedLines.end())
+  {
+    DraggedLine dragged = {line, line->getBeginPoint(), line->getEndPoint(), false, false};
+    it = m_draggedLines.insert(m_draggedLines.end(), dragged);
+  }
+  if (begin)
+  {
+    it->moveBegin = true;
+  }
+  else
+  {
+    it->moveEnd = true;
+  }
+}
+
+/*
+ * Start dragging the junction at the beginning or end of line: that of the
+ * lines it leads into, or comes from, and all the lines into and out of those
+ */
+void NetworkEditor::beginDrag(Line * line, bool begin, const Coordinates & point)
+{
+  m_draggedLines.clear();
+  addDraggedEnd(line, begin);
+
+  const std::vector<Line *> & neighbours = begin ? line->getIn() : line->getOut();
+  for (std::vector<Line *>::const_iterator it = neighbours.cbegin(); it != neighbours.cend(); ++it)
+  {
+    addDraggedEnd(*it, !begin);
+    const std::vector<Line *> & siblings = begin ? (*it)->getOut() : (*it)->getIn();
+    for (std::vector<Line *>::const_iterator siblingIt = siblings.cbegin();
+        siblingIt != siblings.cend(); ++siblingIt)
+    {
+      addDraggedEnd(*siblingIt, begin);
+    }
+  }
+
+  m_dragStart = point;
+  m_dragging = true;
+}
+
+// Move the dragged junction, unless that would leave a line without length
+void NetworkEditor::moveDraggedJunction(const Coordinates & point)
+{
+  float dx = point.x - m_dragStart.x;
+  float dy = point.y - m_dragStart.y;
+
+  std::vector<std::pair<Coordinates, Coordinates> > moved;
+  for (std::vector<DraggedLine>::const_iterator it = m_draggedLines.cbegin();
+      it != m_draggedLines.cend(); ++it)
+  {
+    Coordinates begin = it->beginPoint;
+    Coordinates end = it->endPoint;
+    if (it->moveBegin)
+    {
+      begin.x += dx;
+      begin.y += dy;
+    }
+    if (it->moveEnd)
+    {
+      end.x += dx;
+      end.y += dy;
+    }
+    if (lineLength(begin, end) <= 0)
+    {
+      return;
+    }
+    moved.push_back(std::pair<Coordinates, Coordinates>(begin, end));
+  }
+
+  for (size_t i = 0; i < m_draggedLines.size(); ++i)
+  {
+    Line * line = m_draggedLines[i].line;
+    m_index.remove(line);
+    p_transportNetwork->moveLine(line, moved[i].first, moved[i].second);
+    m_index.insert(line);
+  }
+}
+
+void NetworkEditor::selectLine(Line * line)
+{
+  m_selectedLine = line;
+  m_selectedPacket = NO_PACKET;
+}
+
+void NetworkEditor::selectPacket(PacketId packetId)
+{
+  TransportNetworkPacket * packet = p_transportNetwork->getPacket(packetId);
+  if (packet == NULL)
+  {
+    return;
+  }
+  m_selectedPacket = packetId;
+  m_selectedLine = packet->mutableData.NOW().line;
+}
+
+/*
+ * Drag an end of the selected line if the mouse is on one, otherwise
+ * select the packet or line under it
+ */
+void NetworkEditor::mousePressed(int x, int y)
+{
+  Coordinates point;
+  if (!screenToGround(x, y, point))
+  {
+    return;
+  }
+
+  if (m_selectedLine != NULL)
+  {
+    Coordinates ends[2] = {m_selectedLine->getBeginPoint(), m_selectedLine->getEndPoint()};
+    for (int i = 0; i < 2; ++i)
+    {
+      if (groundDistance(ends[i], point) <= PICK_DISTANCE)
+      {
+        beginDrag(m_selectedLine, i == 0, point);
+        return;
+      }
+    }
+  }
+
+  Line * line = m_index.findNearestLine(point.x, point.y, PICK_DISTANCE);
+  if (line == NULL)
+  {
+    selectLine(NULL);
+    return;
+  }
+  float fraction;
+  distanceToLine(line, point.x, point.y, &fraction);
+  PacketId packetId = findPacket(line, fraction);
+  if (packetId != NO_PACKET)
+  {
+    selectPacket(packetId);
+  }
+  else
+  {
+    selectLine(line);
+  }
+}
+
+void NetworkEditor::mouseMoved(int x, int y)
+{
+  Coordinates point;
+  if (m_dragging && screenToGround(x, y, point))
+  {
+    moveDraggedJunction(point);
+  }
+}
+
+void NetworkEditor::mouseReleased()
+{
+  m_dragging = false;
+  m_draggedLines.clear();
+}
+
+/*
+ * Highlight the selection, in network coordinates, and take the view for
+ * picking. Called with the camera set up, after the network is drawn.
+ */
+void NetworkEditor::draw()
+{
+  glGetFloatv(GL_MODELVIEW_MATRIX, m_modelview);
+  glGetFloatv(GL_PROJECTION_MATRIX, m_projection);
+  glGetIntegerv(GL_VIEWPORT, m_viewport);
+  m_hasView = true;
+
+  TransportNetworkPacket * packet = NULL;
+  if (m_selectedPacket != NO_PACKET)
+  {
+    packet = p_transportNetwork->getPacket(m_selectedPacket);
+    if (packet == NULL)
+    {
+      m_selectedPacket = NO_PACKET;
+    }
+    else
+    {
+      m_selectedLine = packet->mutableData.NOW().line;
+    }
+  }
+
+  if (packet != NULL)
+  {
+    // The rest of its route
+    const Route & route = packet->mutableData.NOW().route;
+    glLineWidth(3.0);
+    glColor3f(1.0f, 0.6f, 0.1f);
+    glBegin(GL_LINES);
+    for (Route::const_iterator it = route.cbegin(); it != route.cend(); ++it)
+    {
+      if (*it == m_selectedLine)
+      {
+        continue;
+      }
+      Coordinates begin = (*it)->getBeginPoint();
+      Coordinates end = (*it)->getEndPoint();
+      glVertex3f(begin.x, begin.y, begin.z);
+      glVertex3f(end.x, end.y, end.z);
+    }
+    glEnd();
+  }
+
+  if (m_selectedLine != NULL)
+  {
+    Coordinates begin = m_selectedLine->getBeginPoint();
+    Coordinates end = m_selectedLine->getEndPoint();
+    glLineWidth(4.0);
+    glColor3f(1.0f, 1.0f, 0.2f);
+    glBegin(GL_LINES);
+    glVertex3f(begin.x, begin.y, begin.z);
+    glVertex3f(end.x, end.y, end.z);
+    glEnd();
+
+    // Drag handles
+    glPointSize(8.0);
+    glBegin(GL_POINTS);
+    glVertex3f(begin.x, begin.y, begin.z);
+    glVertex3f(end.x, end.y, end.z);
+    glEnd();
+  }
+
+  if (packet != NULL && m_selectedLine != NULL && !m_selectedLine->isMesoscopic())
+  {
+    Coordinates position
+      = m_selectedLine->coordinatesFromLineDistance(packet->mutableData.NOW().positionAtLine);
+    glPointSize(14.0);
+    glColor3f(1.0f, 1.0f, 1.0f);
+    glBegin(GL_POINTS);
+    glVertex3f(position.x, position.y, position.z);
+    glEnd();
+  }
+}
+
+// A button selecting line
+void NetworkEditor::lineButton(Line * line)
+{
+  char label[40];
+  snprintf(label, sizeof(label), "Line %p", static_cast<void *>(line));
+  if (ImGui::SmallButton(label))
+  {
+    selectLine(line);
+  }
+}
+
+// A button selecting a packet
+void NetworkEditor::packetButton(PacketId packetId)
+{
+  char label[40];
+  snprintf(label, sizeof(label), "Packet %u", static_cast<unsigned int>(packetId & PACKET_INDEX_MASK));
+  ImGui::PushID(static_cast<int>(packetId));
+  if (ImGui::SmallButton(label))
+  {
+    selectPacket(packetId);
+  }
+  ImGui::PopID();
+}
+
+void NetworkEditor::drawLineInspector()
+{
+  Line * line = m_selectedLine;
+  ImGui::Text("Line %p", static_cast<void *>(line));
+  ImGui::Text("%.1f m%s", line->getLength() / 1000.0f, line->isMesoscopic() ? ", mesoscopic" : "");
+  if (line->getSpeedLimit() != NO_SPEED_LIMIT)
+  {
+    ImGui::Text("Speed limit %d km/h", line->getSpeedLimit() / MMPS_PER_KMPH);
+  }
+  ImGui::Text("%d packets, %d queued, %u passed", line->getNumberOfPackets(),
+              line->getQueueLength(), line->getPassedPackets());
+
+  bool closed = line->isClosed();
+  if (ImGui::Checkbox("Closed", &closed))
+  {
+    p_transportNetwork->setLineClosed(line, closed);
+  }
+
+  // Sparklines
+  bool watched = p_statistics->isWatched(line);
+  if (ImGui::Checkbox("Watch", &watched))
+  {
+    if (watched)
+    {
+      p_statistics->watch(line);
+    }
+    else
+    {
+      p_statistics->unwatch(line);
+    }
+  }
+  const LineHistory * history = p_statistics->getHistory(line);
+  if (history != NULL)
+  {
+    int latest = (history->next + LINE_HISTORY_LENGTH - 1) % LINE_HISTORY_LENGTH;
+    char overlay[40];
+    snprintf(overlay, sizeof(overlay), "%.1f", history->occupancy[latest]);
+    ImGui::PlotLines("Occupancy", history->occupancy, LINE_HISTORY_LENGTH, history->next,
+                     overlay, 0.0f, FLT_MAX, ImVec2(0, 40));
+    snprintf(overlay, sizeof(overlay), "%.0f/h", history->throughput[latest]);
+    ImGui::PlotLines("Throughput", history->throughput, LINE_HISTORY_LENGTH, history->next,
+                     overlay, 0.0f, FLT_MAX, ImVec2(0, 40));
+  }
+
+  drawDetectors();
+
+  // Relations; the lines ending where this one does can be merged with or yielded to
+  if (ImGui::TreeNode("Relations"))
+  {
+    const std::vector<Line *> & ins = line->getIn();
+    for (std::vector<Line *>::const_iterator it = ins.cbegin(); it != ins.cend(); ++it)
+    {
+      ImGui::Text("In");
+      ImGui::SameLine();
+      lineButton(*it);
+    }
+    const std::vector<Line *> & outs = line->getOut();
+    for (std::vector<Line *>::const_iterator it = outs.cbegin(); it != outs.cend(); ++it)
+    {
+      ImGui::Text("Out");
+      ImGui::SameLine();
+      lineButton(*it);
+    }
+
+    std::vector<Line *> siblings;
+    for (std::vector<Line *>::const_iterator outIt = outs.cbegin(); outIt != outs.cend(); ++outIt)
+    {
+      const std::vector<Line *> & outIns = (*outIt)->getIn();
+      for (std::vector<Line *>::const_iterator it = outIns.cbegin(); it != outIns.cend(); ++it)
+      {
+        if (*it != line && std::find(siblings.begin(), siblings.end(), *it) == siblings.end())
+        {
+          siblings.push_back(*it);
+        }
+      }
+    }
+
+    const std::vector<Line *> & cooperating = line->getCooperating();
+    const std::vector<Line *> & interfering = line->getInterfering();
+    for (std::vector<Line *>::const_iterator it = siblings.cbegin(); it != siblings.cend(); ++it)
+    {
+      int rule = NO_CONFLICT_RULE;
+      if (std::find(cooperating.begin(), cooperating.end(), *it) != cooperating.end())
+      {
+        rule = MERGE_WITH;
+      }
+      else if (std::find(interfering.begin(), interfering.end(), *it) != interfering.end())
+      {
+        rule = YIELD_TO;
+      }
+
+      ImGui::PushID(*it);
+      lineButton(*it);
+      int newRule = rule;
+      ImGui::SameLine();
+      ImGui::RadioButton("none", &newRule, NO_CONFLICT_RULE);
+      ImGui::SameLine();
+      ImGui::RadioButton("merge", &newRule, MERGE_WITH);
+      ImGui::SameLine();
+      ImGui::RadioButton("yield", &newRule, YIELD_TO);
+      ImGui::PopID();
+      if (newRule != rule)
+      {
+        p_transportNetwork->setConflictRule(line, *it, static_cast<ConflictRule>(newRule));
+      }
+    }
+    ImGui::TreePop();
+  }
+}
+
+// The loop detectors on the selected line, with their sliding window aggregates
+void NetworkEditor::drawDetectors()
+{
+  Line * line = m_selectedLine;
+  const std::vector<LoopDetector *> & detectors = line->getDetectors();
+  if (!ImGui::TreeNode("Detectors", "Detectors (%d)", static_cast<int>(detectors.size())))
+  {
+    return;
+  }
+
+  LoopDetector * removed = NULL;
+  for (std::vector<LoopDetector *>::const_iterator it = detectors.cbegin(); it != detectors.cend(); ++it)
+  {
+    const LoopDetector & detector = **it;
+    ImGui::PushID(*it);
+    ImGui::Text("%.1f m: %.0f/h, %.0f%% occupied, %.0f km/h", detector.position / 1000.0f,
+                detector.getFlow(), 100.0f * detector.getOccupancy(),
+                static_cast<float>(detector.getSpeed()) / MMPS_PER_KMPH);
+    ImGui::SameLine();
+    if (ImGui::SmallButton("Remove"))
+    {
+      removed = *it;
+    }
+    ImGui::PopID();
+  }
+  if (removed != NULL)
+  {
+    p_trafficStatistics->removeDetector(removed);
+  }
+
+  if (ImGui::SmallButton("Add detector halfway"))
+  {
+    p_trafficStatistics->addDetector(line, line->getLength() / 2);
+  }
+  ImGui::TreePop();
+}
+
+void NetworkEditor::drawPacketInspector()
+{
+  TransportNetworkPacket * packet = p_transportNetwork->getPacket(m_selectedPacket);
+  const TransportNetworkPacketMutableData & data = packet->mutableData.NOW();
+
+  ImGui::Text("Packet %u, generation %u", static_cast<unsigned int>(m_selectedPacket & PACKET_INDEX_MASK),
+              static_cast<unsigned int>(m_selectedPacket >> PACKET_INDEX_BITS));
+  ImGui::Text("%s, %.1f m, prefers %d km/h", VEHICLE_CLASS_NAMES[packet->vehicleClass],
+              packet->length / 1000.0f, packet->preferredSpeed / MMPS_PER_KMPH);
+  ImGui::Text("%.1f km/h at %.1f m", static_cast<float>(data.speed) / MMPS_PER_KMPH,
+              data.positionAtLine / 1000.0f);
+  ImGui::Text("Speed action: %s", SPEED_ACTION_NAMES[data.speedAction]);
+  ImGui::Text("On the way %d s, %.1f s delayed, %d stops",
+              p_transportNetwork->getTripTime(m_selectedPacket),
+              static_cast<float>(packet->delay) / MILLISECONDS_PER_TICK, packet->stops);
+
+  if (p_transportNetwork->getPacket(data.waitingFor) != NULL)
+  {
+    ImGui::Text("Waiting %d ticks for", data.waitedTime);
+    ImGui::SameLine();
+    packetButton(data.waitingFor);
+    if (data.physicallyBlocked)
+    {
+      ImGui::SameLine();
+      ImGui::Text("(blocked)");
+    }
+  }
+  else
+  {
+    ImGui::Text("Waiting for nobody");
+  }
+
+  if (ImGui::TreeNode("Yielding for", "Yielding for %d", static_cast<int>(data.packetIDsToYieldFor.size())))
+  {
+    for (std::set<PacketId>::const_iterator it = data.packetIDsToYieldFor.cbegin();
+        it != data.packetIDsToYieldFor.cend(); ++it)
+    {
+      packetButton(*it);
+    }
+    ImGui::TreePop();
+  }
+
+  if (ImGui::TreeNode("Route", "Route of %d lines", data.route.size()))
+  {
+    for (Route::const_iterator it = data.route.cbegin(); it != data.route.cend(); ++it)
+    {
+      ImGui::PushID(static_cast<int>(it - data.route.cbegin()));
+      lineButton(*it);
+      ImGui::PopID();
+    }
+    ImGui::TreePop();
+  }
+}
+
+void NetworkEditor::drawWindow()
+{
+  ImGui::Begin("Inspector");
+  if (m_selectedPacket != NO_PACKET && p_transportNetwork->getPacket(m_selectedPacket) == NULL)
+  {
+    m_selectedPacket = NO_PACKET;
+  }
+
+  if (m_selectedPacket != NO_PACKET)
+  {
+    drawPacketInspector();
+    ImGui::Separator();
+  }
+  if (m_selectedLine != NULL)
+  {
+    drawLineInspector();
+  }
+  else
+  {
+    ImGui::Text("Click a line or packet to inspect it,");
+    ImGui::Text("and drag the ends of a selected line.");
+  }
+  ImGui::End();
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "line.h"
+#include "spatialindex.h"
+
+#include <vector>
+
+class LineStatistics; // Forward declaration
+class TrafficStatistics; // Forward declaration
+
+// A line with an end at the junction being dragged, as it was before
+struct DraggedLine
+{
+  Line * line;
+  Coordinates beginPoint;
+  Coordinates endPoint;
+  bool moveBegin;
+  bool moveEnd;
+};
+
+/*
+ * Inspector and editor for a TransportNetwork, on ImGui
+ *
+ * A click selects the packet or line under the mouse, found through a
+ * SpatialIndex, and the inspector window shows its NOW state. Dragging an
+ * end of the selected line moves the junction there: the ends of all the
+ * lines into and out of it move along, keeping their lane offsets. The
+ * inspector also sets how the selected line treats the lines ending where
+ * it does, closes it, watches it in a LineStatistics for occupancy and
+ * throughput sparklines, and places loop detectors on it.
+ *
+ * Edits are made from the event loop, between ticks, and only through the
+ * editor, which keeps its index up to date with them.
+ */
+class NetworkEditor
+{
+  private:
+    TransportNetwork * p_transportNetwork;
+    LineStatistics * p_statistics;
+    TrafficStatistics * p_trafficStatistics;
+    SpatialIndex m_index;
+    Line * m_selectedLine;
+    PacketId m_selectedPacket; // NO_PACKET if none
+
+    // The junction being dragged, from where the mouse grabbed it
+    bool m_dragging;
+    Coordinates m_dragStart;
+    std::vector<DraggedLine> m_draggedLines;
+
+    // View of the last draw(), for picking
+    float m_modelview[16];
+    float m_projection[16];
+    int m_viewport[4];
+    bool m_hasView;
+
+    bool screenToGround(int x, int y, Coordinates & point);
+    PacketId findPacket(Line * line, float fraction);
+    void addDraggedEnd(Line * line, bool begin);
+    void beginDrag(Line * line, bool begin, const Coordinates & point);
+    void moveDraggedJunction(const Coordinates & point);
+    void selectLine(Line * line);
+    void selectPacket(PacketId packetId);
+    void lineButton(Line * line);
+    void packetButton(PacketId packetId);
+    void drawLineInspector();
+    void drawDetectors();
+    void drawPacketInspector();
+
+  public:
+    NetworkEditor(TransportNetwork * transportNetwork, LineStatistics * statistics,
+                  TrafficStatistics * trafficStatistics);
+
+    void rebuildIndex();
+
+    void mousePressed(int x, int y);
+    void mouseMoved(int x, int y);
+    void mouseReleased();
+
+    void draw();
+    void drawWindow();
+};
@@ -0,0 +1,348 @@
+#include "networkgenerator.h"
+#include "line.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+const float METRES_PER_UNIT = ZOOM_FACTOR / 1000.0f; // Network file coordinate unit
+const float LANE_WIDTH = 3.5f / METRES_PER_UNIT;
+const int MAX_JITTER = 30; // Percent of spacing; more could make planar graph edges cross
+const float PLANAR_LINES_PER_NODE = 3.9f; // Expected lines per node of a planar graph
+const int SIGNAL_CLEARANCE_TIME = 5; // Ticks
+
+GeneratorOptions::GeneratorOptions()
+  : seed(1),
+    spacing(20),
+    arterialInterval(5),
+    signalTime(0),
+    columns(10),
+    rows(10),
+    jitter(20),
+    segments(40),
+    spokeInterval(5),
+    interchanges(4),
+    lanes(2),
+    rampInterval(6),
+    lines(10000)
+{
+}
+
+/*
+ * Random numbers from a seed
+ *
+ * The engine's sequence is fixed by the standard, but the standard
+ * distributions are not, so the numbers are drawn from the engine directly
+ * to get the same networks everywhere.
+ */
+class GeneratorRandom
+{
+  private:
+    std::mt19937 m_engine;
+
+  public:
+    GeneratorRandom(uint32_t seed)
+      : m_engine(seed)
+    {
+    }
+
+    // In [0, 1)
+    float uniform()
+    {
+      return (m_engine() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // In [-1, 1)
+    float signedUniform()
+    {
+      return 2.0f * uniform() - 1.0f;
+    }
+
+    bool chance(int percent)
+    {
+      return static_cast<int>(m_engine() % 100) < percent;
+    }
+};
+
+static int speedLimitForRank(int rank)
+{
+  if (rank >= HIGHWAY_RANK)
+  {
+    return 110;
+  }
+  if (rank >= ARTERIAL_RANK)
+  {
+    return 70;
+  }
+  return 50;
+}
+
+static bool isArterial(int street, const GeneratorOptions & options)
+{
+  return options.arterialInterval > 0 && street % options.arterialInterval == 0;
+}
+
+// Returns the edge from from to to, the one back follows it
+static int addStreet(NetworkGraph & graph, int from, int to, int rank)
+{
+  return graph.addTwoWayEdge(from, to, rank, speedLimitForRank(rank));
+}
+
+/*
+ * Grid of two-way streets, columns by rows nodes
+ *
+ * Every arterialInterval-th street each way is an arterial, which the
+ * streets crossing it yield to. With a signalTime, where two arterials
+ * cross a two phase signal lets the east-west and north-south lines go in
+ * turn.
+ */
+void generateGrid(NetworkGraph & graph, const GeneratorOptions & options)
+{
+  int columns = std::max(2, options.columns);
+  int rows = std::max(2, options.rows);
+  float spacing = options.spacing;
+
+  int first = graph.getNodeCount();
+  graph.reserve(first + columns * rows, graph.getEdgeCount() + 4 * columns * rows);
+  for (int row = 0; row < rows; ++row)
+  {
+    for (int column = 0; column < columns; ++column)
+    {
+      graph.addNode((column - (columns - 1) / 2.0f) * spacing, (row - (rows - 1) / 2.0f) * spacing);
+    }
+  }
+
+  // Edges into every node, east-west and north-south
+  std::vector<std::vector<int> > eastWestIn(columns * rows), northSouthIn(columns * rows);
+  for (int row = 0; row < rows; ++row)
+  {
+    for (int column = 0; column < columns; ++column)
+    {
+      int index = row * columns + column;
+      int node = first + index;
+      if (column + 1 < columns)
+      {
+        int edge = addStreet(graph, node, node + 1, isArterial(row, options) ? ARTERIAL_RANK : LOCAL_RANK);
+        eastWestIn[index + 1].push_back(edge);
+        eastWestIn[index].push_back(edge + 1);
+      }
+      if (row + 1 < rows)
+      {
+        int edge = addStreet(graph, node, node + columns, isArterial(column, options) ? ARTERIAL_RANK : LOCAL_RANK);
+        northSouthIn[index + columns].push_back(edge);
+        northSouthIn[index].push_back(edge + 1);
+      }
+    }
+  }
+
+  if (options.signalTime <= 0)
+  {
+    return;
+  }
+  for (int row = 0; row < rows; ++row)
+  {
+    for (int column = 0; column < columns; ++column)
+    {
+      if (isArterial(row, options) && isArterial(column, options))
+      {
+        int index = row * columns + column;
+        GraphSignal signal;
+        signal.phaseEdges.push_back(eastWestIn[index]);
+        signal.phaseEdges.push_back(northSouthIn[index]);
+        signal.greenTime = options.signalTime;
+        signal.clearanceTime = SIGNAL_CLEARANCE_TIME;
+        graph.addSignal(signal);
+      }
+    }
+  }
+}
+
+/*
+ * One-way ring road, anticlockwise, of segments lines
+ *
+ * Every spokeInterval-th node has a two-way local road leading out from
+ * the ring, which yields to the ring where it enters.
+ */
+void generateRing(NetworkGraph & graph, const GeneratorOptions & options)
+{
+  int segments = std::max(3, options.segments);
+  float spacing = options.spacing;
+  float radius = segments * spacing / (2 * M_PI);
+
+  int first = graph.getNodeCount();
+  for (int i = 0; i < segments; ++i)
+  {
+    float angle = 2 * M_PI * i / segments;
+    graph.addNode(radius * cos(angle), radius * sin(angle));
+  }
+  for (int i = 0; i < segments; ++i)
+  {
+    graph.addEdge(first + i, first + (i + 1) % segments, ARTERIAL_RANK,
+                  speedLimitForRank(ARTERIAL_RANK));
+  }
+
+  if (options.spokeInterval <= 0)
+  {
+    return;
+  }
+  for (int i = 0; i < segments; i += options.spokeInterval)
+  {
+    float angle = 2 * M_PI * i / segments;
+    int previous = first + i;
+    for (int step = 1; step <= 2; ++step)
+    {
+      float distance = radius + step * spacing;
+      int node = graph.addNode(distance * cos(angle), distance * sin(angle));
+      addStreet(graph, previous, node, LOCAL_RANK);
+      previous = node;
+    }
+  }
+}
+
+/*
+ * Highway corridor with interchanges
+ *
+ * A highway of lanes lanes each way, turning around at both ends, with an
+ * interchange every rampInterval segments. At each interchange an off-ramp
+ * leaves the rightmost lane for a two-way frontage road alongside, and an
+ * on-ramp joins the rightmost lane again, yielding to it. The lanes of each
+ * segment make up a multi-lane road, except for the first and last, where
+ * the lanes fan out and merge.
+ */
+void generateCorridor(NetworkGraph & graph, const GeneratorOptions & options)
+{
+  int lanes = std::max(1, options.lanes);
+  int interchanges = std::max(0, options.interchanges);
+  int rampInterval = std::max(3, options.rampInterval);
+  int positions = (interchanges + 1) * rampInterval; // Segments each way
+  float spacing = options.spacing;
+  float frontageDistance = lanes * LANE_WIDTH + spacing;
+  int highwaySpeed = speedLimitForRank(HIGHWAY_RANK);
+  int rampSpeed = speedLimitForRank(RAMP_RANK);
+
+  int starts[2], ends[2];
+  for (int direction = 0; direction < 2; ++direction)
+  {
+    // Eastbound below the centre line, westbound above it, rightmost lane outermost
+    float side = direction == 0 ? -1.0f : 1.0f;
+    float along = direction == 0 ? 1.0f : -1.0f;
+    float halfLength = positions * spacing / 2.0f;
+
+    starts[direction] = graph.addNode(-along * halfLength, side * lanes * LANE_WIDTH / 2);
+    std::vector<int> previousNodes(lanes, starts[direction]);
+    std::vector<int> frontageNodes;
+
+    for (int position = 1; position < positions; ++position)
+    {
+      float x = along * (position * spacing - halfLength);
+      std::vector<int> nodes(lanes);
+      std::vector<int> laneEdges(lanes);
+      for (int lane = 0; lane < lanes; ++lane)
+      {
+        nodes[lane] = graph.addNode(x, side * (lanes - lane - 0.5f) * LANE_WIDTH);
+        laneEdges[lane] = graph.addEdge(previousNodes[lane], nodes[lane], HIGHWAY_RANK, highwaySpeed);
+      }
+      if (position > 1 && lanes > 1)
+      {
+        graph.addRoad(laneEdges);
+      }
+
+      // Off-ramp before the interchange, on-ramp after it
+      if (position % rampInterval == rampInterval - 1 && position + 2 < positions)
+      {
+        int frontage = graph.addNode(x + along * spacing, side * frontageDistance);
+        graph.addEdge(nodes[0], frontage, RAMP_RANK, rampSpeed);
+        if (!frontageNodes.empty())
+        {
+          addStreet(graph, frontageNodes.back(), frontage, LOCAL_RANK);
+        }
+        frontageNodes.push_back(frontage);
+      }
+      if (position % rampInterval == 1 && !frontageNodes.empty() && position > rampInterval)
+      {
+        graph.addEdge(frontageNodes.back(), nodes[0], RAMP_RANK, rampSpeed);
+      }
+      previousNodes.swap(nodes);
+    }
+
+    ends[direction] = graph.addNode(along * halfLength, side * lanes * LANE_WIDTH / 2);
+    for (int lane = 0; lane < lanes; ++lane)
+    {
+      graph.addEdge(previousNodes[lane], ends[direction], HIGHWAY_RANK, highwaySpeed);
+    }
+  }
+
+  // Turn around at both ends
+  graph.addEdge(ends[0], starts[1], HIGHWAY_RANK, highwaySpeed);
+  graph.addEdge(ends[1], starts[0], HIGHWAY_RANK, highwaySpeed);
+}
+
+/*
+ * Random planar graph of about lines lines
+ *
+ * A square lattice with its nodes moved at random by up to jitter percent
+ * of spacing. Lattice streets are left out at random, and one diagonal is
+ * added in some of the cells, which keeps the graph planar as long as the
+ * cells stay convex. Every arterialInterval-th street each way is an
+ * arterial, which is always kept, so the graph stays mostly connected.
+ */
+void generatePlanar(NetworkGraph & graph, const GeneratorOptions & options)
+{
+  const int KEEP_PERCENT = 85;
+  const int DIAGONAL_PERCENT = 25;
+
+  GeneratorRandom random(options.seed);
+  int side = std::max(2, static_cast<int>(sqrt(options.lines / PLANAR_LINES_PER_NODE) + 0.5f));
+  float spacing = options.spacing;
+  float jitter = std::min(MAX_JITTER, std::max(0, options.jitter)) * spacing / 100.0f;
+
+  int first = graph.getNodeCount();
+  graph.reserve(first + side * side,
+                graph.getEdgeCount() + static_cast<size_t>(side * PLANAR_LINES_PER_NODE * side));
+  for (int row = 0; row < side; ++row)
+  {
+    for (int column = 0; column < side; ++column)
+    {
+      float x = (column - (side - 1) / 2.0f) * spacing + random.signedUniform() * jitter;
+      float y = (row - (side - 1) / 2.0f) * spacing + random.signedUniform() * jitter;
+      graph.addNode(x, y);
+    }
+  }
+
+  for (int row = 0; row < side; ++row)
+  {
+    for (int column = 0; column < side; ++column)
+    {
+      int node = first + row * side + column;
+      if (column + 1 < side)
+      {
+        bool arterial = isArterial(row, options);
+        if (random.chance(KEEP_PERCENT) || arterial)
+        {
+          addStreet(graph, node, node + 1, arterial ? ARTERIAL_RANK : LOCAL_RANK);
+        }
+      }
+      if (row + 1 < side)
+      {
+        bool arterial = isArterial(column, options);
+        if (random.chance(KEEP_PERCENT) || arterial)
+        {
+          addStreet(graph, node, node + side, arterial ? ARTERIAL_RANK : LOCAL_RANK);
+        }
+      }
+      if (column + 1 < side && row + 1 < side && random.chance(DIAGONAL_PERCENT))
+      {
+        if (random.chance(50))
+        {
+          addStreet(graph, node, node + side + 1, LOCAL_RANK);
+        }
+        else
+        {
+          addStreet(graph, node + 1, node + side, LOCAL_RANK);
+        }
+      }
+    }
+  }
+}
+
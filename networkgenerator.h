@@ -0,0 +1,43 @@
+#pragma once
+
+#include "networkgraph.h"
+
+#include <stdint.h>
+
+/*
+ * Synthetic networks for scaling tests
+ *
+ * Every generator adds its network to a NetworkGraph, which works out the
+ * merges and yields from the road ranks when it is written. The result only
+ * depends on the options, so the same seed always gives the same network.
+ */
+
+const int LOCAL_RANK = 2;
+const int ARTERIAL_RANK = 4;
+const int RAMP_RANK = 6;
+const int HIGHWAY_RANK = 7;
+
+struct GeneratorOptions
+{
+  uint32_t seed;
+  int spacing;          // Network file units between neighbouring nodes
+  int arterialInterval; // Grid and planar: every so many streets is an arterial road
+  int signalTime;       // Grid: green ticks of the signals where arterials cross, 0 for none
+  int columns;          // Grid
+  int rows;             // Grid
+  int jitter;           // Planar: percent of spacing nodes are moved at random, up to 30
+  int segments;         // Ring
+  int spokeInterval;    // Ring: segments between roads leading off it
+  int interchanges;     // Corridor
+  int lanes;            // Corridor: lanes each way
+  int rampInterval;     // Corridor: segments between interchanges
+  int lines;            // Planar: approximate number of lines
+
+  GeneratorOptions();
+};
+
+void generateGrid(NetworkGraph & graph, const GeneratorOptions & options);
+void generateRing(NetworkGraph & graph, const GeneratorOptions & options);
+void generateCorridor(NetworkGraph & graph, const GeneratorOptions & options);
+void generatePlanar(NetworkGraph & graph, const GeneratorOptions & options);
+
@@ -0,0 +1,247 @@
+#include "networkgraph.h"
+#include "line.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+const float METRES_PER_UNIT = ZOOM_FACTOR / 1000.0f; // Network file coordinate unit
+const float TWO_WAY_OFFSET = 1.5f; // Metres to the right of the centre, for two-way lines
+
+int NetworkGraph::addNode(float x, float y)
+{
+  m_x.push_back(x);
+  m_y.push_back(y);
+  return m_x.size() - 1;
+}
+
+int NetworkGraph::addEdge(int from, int to, int rank, int speedLimit)
+{
+  GraphEdge edge = {from, to, -1, rank, speedLimit};
+  m_edges.push_back(edge);
+  return m_edges.size() - 1;
+}
+
+// Add an edge each way; returns the forward one, the backward one follows it
+int NetworkGraph::addTwoWayEdge(int from, int to, int rank, int speedLimit)
+{
+  int forward = m_edges.size();
+  GraphEdge edge = {from, to, forward + 1, rank, speedLimit};
+  GraphEdge reverse = {to, from, forward, rank, speedLimit};
+  m_edges.push_back(edge);
+  m_edges.push_back(reverse);
+  return forward;
+}
+
+// Parallel edges making up a multi-lane road, the rightmost lane first
+void NetworkGraph::addRoad(const std::vector<int> & laneEdges)
+{
+  m_roads.push_back(laneEdges);
+}
+
+void NetworkGraph::addSignal(const GraphSignal & signal)
+{
+  m_signals.push_back(signal);
+}
+
+void NetworkGraph::reserve(size_t nodeCount, size_t edgeCount)
+{
+  m_x.reserve(nodeCount);
+  m_y.reserve(nodeCount);
+  m_edges.reserve(edgeCount);
+}
+
+size_t NetworkGraph::getNodeCount() const
+{
+  return m_x.size();
+}
+
+size_t NetworkGraph::getEdgeCount() const
+{
+  return m_edges.size();
+}
+
+const GraphEdge & NetworkGraph::getEdge(int edge) const
+{
+  return m_edges[edge];
+}
+
+/*
+ * Whether edges a and b, into the same node with outCount edges out of it,
+ * can continue onto the same edge. Neither continues onto its twin, unless
+ * it is the only way on.
+ */
+static bool shareOut(const GraphEdge & a, const GraphEdge & b, const std::vector<int> & outEdges,
+                     int outBegin, int outCount)
+{
+  if (outCount <= 1 || outCount >= 3)
+  {
+    return outCount > 0;
+  }
+  for (int k = outBegin; k < outBegin + outCount; ++k)
+  {
+    if (outEdges[k] != a.twin && outEdges[k] != b.twin)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Write the graph as a network file, numbering the lines from 1.
+// Fails without writing if any edge joins two nodes at the same place.
+bool NetworkGraph::write(const std::string & fileName, const std::string & origin,
+                         NetworkGraphStatistics & statistics) const
+{
+  memset(&statistics, 0, sizeof(statistics));
+  statistics.lines = m_edges.size();
+  size_t nodeCount = m_x.size();
+
+  // Edges out of and into every node
+  std::vector<int> outOffsets(nodeCount + 1, 0), inOffsets(nodeCount + 1, 0);
+  for (std::vector<GraphEdge>::const_iterator it = m_edges.cbegin(); it != m_edges.cend(); ++it)
+  {
+    ++outOffsets[it->from + 1];
+    ++inOffsets[it->to + 1];
+  }
+  for (size_t i = 0; i < nodeCount; ++i)
+  {
+    outOffsets[i + 1] += outOffsets[i];
+    inOffsets[i + 1] += inOffsets[i];
+  }
+  // A line needs a direction, and a two-way one an offset to its side
+  for (size_t i = 0; i < m_edges.size(); ++i)
+  {
+    if (m_x[m_edges[i].from] == m_x[m_edges[i].to] && m_y[m_edges[i].from] == m_y[m_edges[i].to])
+    {
+      std::cerr << fileName << ": line " << i + 1 << " would have zero length" << std::endl;
+      return false;
+    }
+  }
+
+  std::vector<int> outEdges(m_edges.size()), inEdges(m_edges.size());
+  {
+    std::vector<int> nextOut(outOffsets.begin(), outOffsets.end() - 1);
+    std::vector<int> nextIn(inOffsets.begin(), inOffsets.end() - 1);
+    for (size_t i = 0; i < m_edges.size(); ++i)
+    {
+      outEdges[nextOut[m_edges[i].from]++] = i;
+      inEdges[nextIn[m_edges[i].to]++] = i;
+    }
+  }
+
+  FILE * networkFile = fopen(fileName.c_str(), "w");
+  if (networkFile == NULL)
+  {
+    std::cerr << fileName << ": cannot create file" << std::endl;
+    return false;
+  }
+  fprintf(networkFile, "# %s\n", origin.c_str());
+  fprintf(networkFile, "# Line number, begin x, begin y, begin z, end x, end y, end z,\n"
+                       "# number of in lines, in line 1, in line 2, etc.\n"
+                       "# number of out lines, out line 1, out line 2, etc.\n"
+                       "# number of merge lines, merge line 1, merge line 2, etc.\n"
+                       "# number of yield lines, yield line 1, yield line 2, etc.\n"
+                       "# speed limit in km/h (0 for none)\n\n");
+
+  std::vector<int> outs, merges, yields;
+  for (size_t i = 0; i < m_edges.size(); ++i)
+  {
+    const GraphEdge & edge = m_edges[i];
+    int node = edge.to;
+    int outBegin = outOffsets[node];
+    int outCount = outOffsets[node + 1] - outBegin;
+
+    outs.clear();
+    for (int k = outBegin; k < outBegin + outCount; ++k)
+    {
+      if (outEdges[k] != edge.twin || outCount == 1)
+      {
+        outs.push_back(outEdges[k]);
+      }
+    }
+
+    merges.clear();
+    yields.clear();
+    for (int k = inOffsets[node]; k < inOffsets[node + 1]; ++k)
+    {
+      const GraphEdge & other = m_edges[inEdges[k]];
+      if (inEdges[k] == static_cast<int>(i) || other.rank < edge.rank
+          || !shareOut(edge, other, outEdges, outBegin, outCount))
+      {
+        continue;
+      }
+      if (other.rank == edge.rank)
+      {
+        merges.push_back(inEdges[k]);
+      }
+      else
+      {
+        yields.push_back(inEdges[k]);
+      }
+    }
+    statistics.merges += merges.size();
+    statistics.yields += yields.size();
+
+    float beginX = m_x[edge.from], beginY = m_y[edge.from];
+    float endX = m_x[edge.to], endY = m_y[edge.to];
+    if (edge.twin >= 0)
+    {
+      float dx = endX - beginX, dy = endY - beginY;
+      float length = sqrt(dx * dx + dy * dy);
+      float offset = TWO_WAY_OFFSET / METRES_PER_UNIT;
+      beginX += dy / length * offset;
+      beginY -= dx / length * offset;
+      endX += dy / length * offset;
+      endY -= dx / length * offset;
+    }
+    fprintf(networkFile, "%zu %.2f %.2f 0 %.2f %.2f 0 0", i + 1, beginX, beginY, endX, endY);
+
+    const std::vector<int> * relations[] = {&outs, &merges, &yields};
+    for (int r = 0; r < 3; ++r)
+    {
+      fprintf(networkFile, " %zu", relations[r]->size());
+      for (std::vector<int>::const_iterator it = relations[r]->cbegin(); it != relations[r]->cend(); ++it)
+      {
+        fprintf(networkFile, " %d", *it + 1);
+      }
+    }
+    fprintf(networkFile, " %d\n", edge.speedLimit);
+  }
+
+  for (std::vector<std::vector<int> >::const_iterator roadIt = m_roads.cbegin();
+      roadIt != m_roads.cend(); ++roadIt)
+  {
+    fprintf(networkFile, "road %zu", roadIt->size());
+    for (std::vector<int>::const_iterator it = roadIt->cbegin(); it != roadIt->cend(); ++it)
+    {
+      fprintf(networkFile, " %d", *it + 1);
+    }
+    fprintf(networkFile, "\n");
+  }
+
+  for (std::vector<GraphSignal>::const_iterator signalIt = m_signals.cbegin();
+      signalIt != m_signals.cend(); ++signalIt)
+  {
+    fprintf(networkFile, "signal %zu", signalIt->phaseEdges.size());
+    for (std::vector<std::vector<int> >::const_iterator phaseIt = signalIt->phaseEdges.cbegin();
+        phaseIt != signalIt->phaseEdges.cend(); ++phaseIt)
+    {
+      fprintf(networkFile, "  %d %d %zu", signalIt->greenTime, signalIt->clearanceTime, phaseIt->size());
+      for (std::vector<int>::const_iterator it = phaseIt->cbegin(); it != phaseIt->cend(); ++it)
+      {
+        fprintf(networkFile, " %d", *it + 1);
+      }
+    }
+    fprintf(networkFile, "\n");
+  }
+
+  if (fclose(networkFile) != 0)
+  {
+    std::cerr << fileName << ": cannot write file" << std::endl;
+    return false;
+  }
+  return true;
+}
+
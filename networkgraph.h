@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+struct GraphEdge
+{
+  int from;       // Node the line begins at
+  int to;         // Node the line ends at
+  int twin;       // The edge in the other direction along the same stretch, or -1
+  int rank;       // Higher for more important roads
+  int speedLimit; // km/h, 0 for none
+};
+
+// Fixed time signal, with the edges green in each phase
+struct GraphSignal
+{
+  std::vector<std::vector<int> > phaseEdges;
+  int greenTime;     // Ticks, for every phase
+  int clearanceTime; // Ticks
+};
+
+struct NetworkGraphStatistics
+{
+  size_t lines;
+  size_t merges;
+  size_t yields;
+};
+
+/*
+ * Road graph to be written as a network file
+ *
+ * Nodes are points in network file units, and every edge becomes a Line.
+ * Lines meeting at a node are connected, except for U-turns onto the twin
+ * edge other than at dead ends. Where lines into a node lead to the same
+ * line out of it, lines of equal rank merge (cooperating lines), and lines
+ * of a lower rank yield to those of a higher one (interfering lines). Two-way
+ * stretches are drawn apart, each direction to its right of the centre.
+ *
+ * Relations are worked out while writing, from compact per-node indexes,
+ * so graphs of many millions of edges can be written without building a
+ * Line for each.
+ */
+class NetworkGraph
+{
+  private:
+    std::vector<float> m_x;
+    std::vector<float> m_y;
+    std::vector<GraphEdge> m_edges;
+    std::vector<std::vector<int> > m_roads;
+    std::vector<GraphSignal> m_signals;
+
+  public:
+    int addNode(float x, float y);
+    int addEdge(int from, int to, int rank, int speedLimit);
+    int addTwoWayEdge(int from, int to, int rank, int speedLimit);
+    void addRoad(const std::vector<int> & laneEdges);
+    void addSignal(const GraphSignal & signal);
+    void reserve(size_t nodeCount, size_t edgeCount);
+
+    size_t getNodeCount() const;
+    size_t getEdgeCount() const;
+    const GraphEdge & getEdge(int edge) const;
+
+    bool write(const std::string & fileName, const std::string & origin,
+               NetworkGraphStatistics & statistics) const;
+};
+
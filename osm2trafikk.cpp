@@ -0,0 +1,44 @@
+#include <iostream>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "osmimport.h"
+
+/*
+ * Convert an OpenStreetMap extract into a network file
+ *
+ * osm2trafikk input.osm.pbf output.txt [threads]
+ */
+int main(int argc, char * argv[])
+{
+  if (argc < 3 || argc > 4)
+  {
+    std::cerr << "Usage: " << argv[0] << " input.osm.pbf output.txt [threads]" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  int threads = std::thread::hardware_concurrency();
+  if (argc == 4)
+  {
+    threads = atoi(argv[3]);
+  }
+  if (threads < 1)
+  {
+    threads = 1;
+  }
+
+  OsmImportStatistics statistics;
+  if (!importOsmPbf(argv[1], argv[2], threads, statistics))
+  {
+    return EXIT_FAILURE;
+  }
+
+  std::cout << statistics.ways << " ways, "
+            << statistics.nodes << " nodes, "
+            << statistics.lines << " lines, "
+            << statistics.merges << " merges, "
+            << statistics.yields << " yields" << std::endl;
+  return EXIT_SUCCESS;
+}
+
@@ -0,0 +1,817 @@
+#include "osmimport.h"
+#include "networkgraph.h"
+#include "line.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <thread>
+#include <zlib.h>
+
+const size_t MAX_BLOB_HEADER_SIZE = 64 * 1024;
+const size_t MAX_BLOB_SIZE = 32 * 1024 * 1024;
+const int BLOBS_PER_THREAD = 2; // Blobs read ahead for each decoding thread
+
+const double METRES_PER_DEGREE = 111319.49;
+const double METRES_PER_UNIT = ZOOM_FACTOR / 1000.0; // Network file coordinate unit
+
+/*
+ * Protocol buffer wire format reader
+ *
+ * Just enough of it to read OSM PBF files, without generated code.
+ */
+class ProtoReader
+{
+  private:
+    const uint8_t * m_position;
+    const uint8_t * m_end;
+    bool m_failed;
+
+  public:
+    ProtoReader(const uint8_t * begin, const uint8_t * end)
+    {
+      m_position = begin;
+      m_end = end;
+      m_failed = false;
+    }
+
+    bool failed()
+    {
+      return m_failed;
+    }
+
+    bool atEnd()
+    {
+      return m_failed || m_position >= m_end;
+    }
+
+    uint64_t varint()
+    {
+      uint64_t value = 0;
+      for (int shift = 0; shift < 64; shift += 7)
+      {
+        if (m_position >= m_end)
+        {
+          m_failed = true;
+          return 0;
+        }
+        uint8_t byte = *m_position++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+          return value;
+        }
+      }
+      m_failed = true;
+      return 0;
+    }
+
+    int64_t svarint()
+    {
+      uint64_t value = varint();
+      return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    // Read a field key; false at the end of the message
+    bool next(int & field, int & wireType)
+    {
+      if (atEnd())
+      {
+        return false;
+      }
+      uint64_t key = varint();
+      field = static_cast<int>(key >> 3);
+      wireType = static_cast<int>(key & 7);
+      return !m_failed;
+    }
+
+    // Length delimited field, as a reader of its own
+    ProtoReader bytes()
+    {
+      uint64_t length = varint();
+      if (m_failed || length > static_cast<uint64_t>(m_end - m_position))
+      {
+        m_failed = true;
+        return ProtoReader(m_end, m_end);
+      }
+      ProtoReader result(m_position, m_position + length);
+      m_position += length;
+      return result;
+    }
+
+    const uint8_t * position()
+    {
+      return m_position;
+    }
+
+    size_t size()
+    {
+      return m_end - m_position;
+    }
+
+    void skip(int wireType)
+    {
+      size_t length = 0;
+      switch (wireType)
+      {
+        case 0:
+          varint();
+          return;
+        case 1:
+          length = 8;
+          break;
+        case 2:
+          bytes();
+          return;
+        case 5:
+          length = 4;
+          break;
+        default:
+          m_failed = true;
+          return;
+      }
+      if (length > size())
+      {
+        m_failed = true;
+        return;
+      }
+      m_position += length;
+    }
+};
+
+// Read a repeated integer field, packed or not, into values
+static void readRepeated(ProtoReader & reader, int wireType, bool zigzag, std::vector<int64_t> & values)
+{
+  if (wireType == 2)
+  {
+    ProtoReader packed = reader.bytes();
+    while (!packed.atEnd())
+    {
+      values.push_back(zigzag ? packed.svarint() : static_cast<int64_t>(packed.varint()));
+    }
+  }
+  else
+  {
+    values.push_back(zigzag ? reader.svarint() : static_cast<int64_t>(reader.varint()));
+  }
+}
+
+struct RawBlob
+{
+  std::string type;
+  std::vector<uint8_t> data;
+};
+
+static bool readFully(std::ifstream & file, uint8_t * buffer, size_t size)
+{
+  file.read(reinterpret_cast<char *>(buffer), size);
+  return static_cast<size_t>(file.gcount()) == size;
+}
+
+// Read the next blob of a PBF file; false at the end of the file or on error
+static bool readBlob(std::ifstream & file, RawBlob & blob, bool & failed)
+{
+  failed = false;
+  uint8_t sizeBytes[4];
+  file.read(reinterpret_cast<char *>(sizeBytes), 4);
+  if (file.gcount() == 0)
+  {
+    return false;
+  }
+  if (file.gcount() != 4)
+  {
+    failed = true;
+    return false;
+  }
+  size_t headerSize = (static_cast<size_t>(sizeBytes[0]) << 24) | (sizeBytes[1] << 16)
+                    | (sizeBytes[2] << 8) | sizeBytes[3];
+  if (headerSize > MAX_BLOB_HEADER_SIZE)
+  {
+    failed = true;
+    return false;
+  }
+
+  std::vector<uint8_t> header(headerSize);
+  if (!readFully(file, header.data(), headerSize))
+  {
+    failed = true;
+    return false;
+  }
+
+  blob.type.clear();
+  uint64_t dataSize = 0;
+  ProtoReader headerReader(header.data(), header.data() + headerSize);
+  int field, wireType;
+  while (headerReader.next(field, wireType))
+  {
+    if (field == 1 && wireType == 2)
+    {
+      ProtoReader type = headerReader.bytes();
+      blob.type.assign(reinterpret_cast<const char *>(type.position()), type.size());
+    }
+    else if (field == 3 && wireType == 0)
+    {
+      dataSize = headerReader.varint();
+    }
+    else
+    {
+      headerReader.skip(wireType);
+    }
+  }
+  if (headerReader.failed() || dataSize > MAX_BLOB_SIZE)
+  {
+    failed = true;
+    return false;
+  }
+
+  blob.data.resize(dataSize);
+  if (!readFully(file, blob.data.data(), dataSize))
+  {
+    failed = true;
+    return false;
+  }
+  return true;
+}
+
+// Unpack the contents of a blob; false if it is damaged or compressed
+// with anything but zlib
+static bool unpackBlob(const std::vector<uint8_t> & blob, std::vector<uint8_t> & contents)
+{
+  ProtoReader reader(blob.data(), blob.data() + blob.size());
+  uint64_t rawSize = 0;
+  const uint8_t * packed = NULL;
+  size_t packedSize = 0;
+  bool raw = false;
+
+  int field, wireType;
+  while (reader.next(field, wireType))
+  {
+    if (field == 1 && wireType == 2)
+    {
+      ProtoReader data = reader.bytes();
+      contents.assign(data.position(), data.position() + data.size());
+      raw = true;
+    }
+    else if (field == 2 && wireType == 0)
+    {
+      rawSize = reader.varint();
+    }
+    else if (field == 3 && wireType == 2)
+    {
+      ProtoReader data = reader.bytes();
+      packed = data.position();
+      packedSize = data.size();
+    }
+    else if (field >= 4 && wireType == 2)
+    {
+      return false; // lzma, lz4, zstd
+    }
+    else
+    {
+      reader.skip(wireType);
+    }
+  }
+  if (reader.failed())
+  {
+    return false;
+  }
+  if (raw)
+  {
+    return true;
+  }
+  if (packed == NULL || rawSize > MAX_BLOB_SIZE)
+  {
+    return false;
+  }
+
+  contents.resize(rawSize);
+  uLongf unpackedSize = rawSize;
+  return uncompress(contents.data(), &unpackedSize, packed, packedSize) == Z_OK
+      && unpackedSize == rawSize;
+}
+
+// A string in the string table of a primitive block
+struct TableString
+{
+  const char * text;
+  size_t length;
+
+  bool equals(const char * other) const
+  {
+    return strlen(other) == length && strncmp(text, other, length) == 0;
+  }
+
+  std::string str() const
+  {
+    return std::string(text, length);
+  }
+};
+
+static void readStringTable(ProtoReader reader, std::vector<TableString> & table)
+{
+  int field, wireType;
+  while (reader.next(field, wireType))
+  {
+    if (field == 1 && wireType == 2)
+    {
+      ProtoReader text = reader.bytes();
+      TableString string = {reinterpret_cast<const char *>(text.position()), text.size()};
+      table.push_back(string);
+    }
+    else
+    {
+      reader.skip(wireType);
+    }
+  }
+}
+
+// Rank of a highway type, or 0 for ways that are not roads for cars
+static int highwayRank(const TableString & highway)
+{
+  static const char * TYPES[] = {"living_street", "service", "residential", "unclassified",
+                                 "tertiary", "secondary", "primary", "trunk", "motorway"};
+  static const int RANKS[] = {1, 1, 2, 2, 3, 4, 5, 6, 7};
+  const int TYPE_COUNT = sizeof(RANKS) / sizeof(RANKS[0]);
+
+  std::string type = highway.str();
+  bool link = false;
+  if (type.size() > 5 && type.compare(type.size() - 5, 5, "_link") == 0)
+  {
+    type.resize(type.size() - 5);
+    link = true;
+  }
+  for (int i = 0; i < TYPE_COUNT; ++i)
+  {
+    if (type == TYPES[i])
+    {
+      // Ramps yield to the roads they join
+      return link ? RANKS[i] - 1 : RANKS[i];
+    }
+  }
+  return 0;
+}
+
+// km/h from a maxspeed tag, or 0 if it is not a plain number
+static int parseMaxSpeed(const TableString & maxSpeed)
+{
+  std::string text = maxSpeed.str();
+  char * after;
+  long speed = strtol(text.c_str(), &after, 10);
+  if (after == text.c_str() || speed <= 0 || speed > 300)
+  {
+    return 0;
+  }
+  while (*after == ' ')
+  {
+    ++after;
+  }
+  if (strcmp(after, "mph") == 0)
+  {
+    return static_cast<int>(speed * 1.609 + 0.5);
+  }
+  return *after == '\0' ? static_cast<int>(speed) : 0;
+}
+
+static void decodeWay(ProtoReader reader, const std::vector<TableString> & strings,
+                      std::vector<OsmWay> & ways)
+{
+  OsmWay way;
+  way.id = 0;
+  std::vector<int64_t> keys, values, refs;
+
+  int field, wireType;
+  while (reader.next(field, wireType))
+  {
+    if (field == 1 && wireType == 0)
+    {
+      way.id = reader.varint();
+    }
+    else if (field == 2)
+    {
+      readRepeated(reader, wireType, false, keys);
+    }
+    else if (field == 3)
+    {
+      readRepeated(reader, wireType, false, values);
+    }
+    else if (field == 8)
+    {
+      readRepeated(reader, wireType, true, refs);
+    }
+    else
+    {
+      reader.skip(wireType);
+    }
+  }
+
+  way.rank = 0;
+  way.oneway = 0;
+  way.speedLimit = 0;
+  bool onewayTagged = false;
+  bool defaultOneway = false;
+  for (size_t i = 0; i < keys.size() && i < values.size(); ++i)
+  {
+    if (keys[i] >= static_cast<int64_t>(strings.size())
+        || values[i] >= static_cast<int64_t>(strings.size()))
+    {
+      continue;
+    }
+    const TableString & key = strings[keys[i]];
+    const TableString & value = strings[values[i]];
+    if (key.equals("highway"))
+    {
+      way.rank = highwayRank(value);
+      defaultOneway = defaultOneway || value.equals("motorway") || value.equals("motorway_link");
+    }
+    else if (key.equals("junction"))
+    {
+      defaultOneway = defaultOneway || value.equals("roundabout");
+    }
+    else if (key.equals("oneway"))
+    {
+      onewayTagged = true;
+      if (value.equals("yes") || value.equals("true") || value.equals("1"))
+      {
+        way.oneway = 1;
+      }
+      else if (value.equals("-1") || value.equals("reverse"))
+      {
+        way.oneway = -1;
+      }
+    }
+    else if (key.equals("maxspeed"))
+    {
+      way.speedLimit = parseMaxSpeed(value);
+    }
+  }
+  if (!onewayTagged && defaultOneway)
+  {
+    way.oneway = 1;
+  }
+
+  if (way.rank == 0 || refs.size() < 2)
+  {
+    return;
+  }
+
+  // Node references are delta coded
+  int64_t node = 0;
+  way.nodes.reserve(refs.size());
+  for (std::vector<int64_t>::const_iterator it = refs.cbegin(); it != refs.cend(); ++it)
+  {
+    node += *it;
+    way.nodes.push_back(node);
+  }
+  ways.push_back(way);
+}
+
+// Coordinates of the nodes that the ways use, by position in their sorted ids
+struct NodeTable
+{
+  std::vector<int64_t> ids;
+  std::vector<double> lat;
+  std::vector<double> lon;
+
+  void set(int64_t id, double nodeLat, double nodeLon)
+  {
+    std::vector<int64_t>::const_iterator it = std::lower_bound(ids.begin(), ids.end(), id);
+    if (it != ids.end() && *it == id)
+    {
+      // Every node is in one block only, so threads never share an index
+      lat[it - ids.begin()] = nodeLat;
+      lon[it - ids.begin()] = nodeLon;
+    }
+  }
+};
+
+struct BlockCoordinates
+{
+  int64_t granularity;
+  int64_t latOffset;
+  int64_t lonOffset;
+
+  double lat(int64_t value) const
+  {
+    return 1e-9 * (latOffset + granularity * value);
+  }
+
+  double lon(int64_t value) const
+  {
+    return 1e-9 * (lonOffset + granularity * value);
+  }
+};
+
+static void decodeDenseNodes(ProtoReader reader, const BlockCoordinates & coordinates, NodeTable & nodes)
+{
+  std::vector<int64_t> ids, lats, lons;
+  int field, wireType;
+  while (reader.next(field, wireType))
+  {
+    if (field == 1)
+    {
+      readRepeated(reader, wireType, true, ids);
+    }
+    else if (field == 8)
+    {
+      readRepeated(reader, wireType, true, lats);
+    }
+    else if (field == 9)
+    {
+      readRepeated(reader, wireType, true, lons);
+    }
+    else
+    {
+      reader.skip(wireType);
+    }
+  }
+
+  int64_t id = 0, lat = 0, lon = 0;
+  for (size_t i = 0; i < ids.size() && i < lats.size() && i < lons.size(); ++i)
+  {
+    id += ids[i];
+    lat += lats[i];
+    lon += lons[i];
+    nodes.set(id, coordinates.lat(lat), coordinates.lon(lon));
+  }
+}
+
+static void decodeNode(ProtoReader reader, const BlockCoordinates & coordinates, NodeTable & nodes)
+{
+  int64_t id = 0, lat = 0, lon = 0;
+  int field, wireType;
+  while (reader.next(field, wireType))
+  {
+    if (field == 1 && wireType == 0)
+    {
+      id = reader.svarint();
+    }
+    else if (field == 8 && wireType == 0)
+    {
+      lat = reader.svarint();
+    }
+    else if (field == 9 && wireType == 0)
+    {
+      lon = reader.svarint();
+    }
+    else
+    {
+      reader.skip(wireType);
+    }
+  }
+  nodes.set(id, coordinates.lat(lat), coordinates.lon(lon));
+}
+
+/*
+ * Decode a primitive block, collecting its highways into ways if ways is
+ * given, and the coordinates of wanted nodes into nodes if nodes is given.
+ */
+static bool decodePrimitiveBlock(const std::vector<uint8_t> & block,
+                                 std::vector<OsmWay> * ways, NodeTable * nodes)
+{
+  ProtoReader reader(block.data(), block.data() + block.size());
+  std::vector<TableString> strings;
+  std::vector<ProtoReader> groups;
+  BlockCoordinates coordinates = {100, 0, 0};
+
+  int field, wireType;
+  while (reader.next(field, wireType))
+  {
+    if (field == 1 && wireType == 2)
+    {
+      readStringTable(reader.bytes(), strings);
+    }
+    else if (field == 2 && wireType == 2)
+    {
+      groups.push_back(reader.bytes());
+    }
+    else if (field == 17 && wireType == 0)
+    {
+      coordinates.granularity = reader.varint();
+    }
+    else if (field == 19 && wireType == 0)
+    {
+      coordinates.latOffset = reader.varint();
+    }
+    else if (field == 20 && wireType == 0)
+    {
+      coordinates.lonOffset = reader.varint();
+    }
+    else
+    {
+      reader.skip(wireType);
+    }
+  }
+  if (reader.failed())
+  {
+    return false;
+  }
+
+  for (std::vector<ProtoReader>::iterator groupIt = groups.begin(); groupIt != groups.end(); ++groupIt)
+  {
+    ProtoReader & group = *groupIt;
+    while (group.next(field, wireType))
+    {
+      if (field == 1 && wireType == 2 && nodes)
+      {
+        decodeNode(group.bytes(), coordinates, *nodes);
+      }
+      else if (field == 2 && wireType == 2 && nodes)
+      {
+        decodeDenseNodes(group.bytes(), coordinates, *nodes);
+      }
+      else if (field == 3 && wireType == 2 && ways)
+      {
+        decodeWay(group.bytes(), strings, *ways);
+      }
+      else
+      {
+        group.skip(wireType);
+      }
+    }
+    if (group.failed())
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Decode all data blocks of a PBF file, threads blocks at a time.
+ * Ways found in each batch are appended to ways in file order.
+ */
+static bool decodeFile(const std::string & fileName, int threads,
+                       std::vector<OsmWay> * ways, NodeTable * nodes)
+{
+  std::ifstream file(fileName.c_str(), std::ios::binary);
+  if (!file.is_open())
+  {
+    std::cerr << fileName << ": cannot open file" << std::endl;
+    return false;
+  }
+
+  size_t batchSize = threads * BLOBS_PER_THREAD;
+  std::vector<RawBlob> blobs(batchSize);
+  std::vector<std::vector<OsmWay> > batchWays(batchSize);
+  std::vector<char> decoded(batchSize);
+  size_t blobIndex = 0;
+  bool endOfFile = false;
+
+  while (!endOfFile)
+  {
+    size_t count = 0;
+    while (count < batchSize)
+    {
+      bool failed;
+      if (!readBlob(file, blobs[count], failed))
+      {
+        if (failed)
+        {
+          std::cerr << fileName << ": damaged blob " << blobIndex + count << std::endl;
+          return false;
+        }
+        endOfFile = true;
+        break;
+      }
+      if (blobs[count].type == "OSMData")
+      {
+        ++count;
+      }
+    }
+
+    std::vector<std::thread> workers;
+    for (int thread = 0; thread < threads; ++thread)
+    {
+      workers.push_back(std::thread([&, thread]()
+      {
+        std::vector<uint8_t> contents;
+        for (size_t i = thread; i < count; i += threads)
+        {
+          batchWays[i].clear();
+          decoded[i] = unpackBlob(blobs[i].data, contents)
+                    && decodePrimitiveBlock(contents, ways ? &batchWays[i] : NULL, nodes);
+        }
+      }));
+    }
+    for (std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it)
+    {
+      it->join();
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      if (!decoded[i])
+      {
+        std::cerr << fileName << ": cannot decode data block " << blobIndex + i
+                  << " (only zlib compression is supported)" << std::endl;
+        return false;
+      }
+      if (ways)
+      {
+        ways->insert(ways->end(), batchWays[i].begin(), batchWays[i].end());
+      }
+    }
+    blobIndex += count;
+  }
+  return true;
+}
+
+bool importOsmPbf(const std::string & pbfFileName,
+                  const std::string & networkFileName,
+                  int threads,
+                  OsmImportStatistics & statistics)
+{
+  threads = std::max(1, threads);
+  memset(&statistics, 0, sizeof(statistics));
+
+  // First pass: the highways
+  std::vector<OsmWay> ways;
+  if (!decodeFile(pbfFileName, threads, &ways, NULL))
+  {
+    return false;
+  }
+
+  // Second pass: the nodes they use
+  NodeTable nodes;
+  for (std::vector<OsmWay>::const_iterator it = ways.cbegin(); it != ways.cend(); ++it)
+  {
+    nodes.ids.insert(nodes.ids.end(), it->nodes.begin(), it->nodes.end());
+  }
+  std::sort(nodes.ids.begin(), nodes.ids.end());
+  nodes.ids.erase(std::unique(nodes.ids.begin(), nodes.ids.end()), nodes.ids.end());
+  nodes.lat.assign(nodes.ids.size(), std::numeric_limits<double>::quiet_NaN());
+  nodes.lon.assign(nodes.ids.size(), std::numeric_limits<double>::quiet_NaN());
+  if (!decodeFile(pbfFileName, threads, NULL, &nodes))
+  {
+    return false;
+  }
+
+  // Project around the middle of the network
+  double minLat = 90, maxLat = -90, minLon = 180, maxLon = -180;
+  for (size_t i = 0; i < nodes.ids.size(); ++i)
+  {
+    if (!std::isnan(nodes.lat[i]))
+    {
+      minLat = std::min(minLat, nodes.lat[i]);
+      maxLat = std::max(maxLat, nodes.lat[i]);
+      minLon = std::min(minLon, nodes.lon[i]);
+      maxLon = std::max(maxLon, nodes.lon[i]);
+    }
+  }
+  double centreLat = (minLat + maxLat) / 2;
+  double centreLon = (minLon + maxLon) / 2;
+  double lonScale = cos(centreLat * M_PI / 180) * METRES_PER_DEGREE;
+
+  NetworkGraph graph;
+  graph.reserve(nodes.ids.size(), 0);
+  for (size_t i = 0; i < nodes.ids.size(); ++i)
+  {
+    graph.addNode((nodes.lon[i] - centreLon) * lonScale / METRES_PER_UNIT,
+                  (nodes.lat[i] - centreLat) * METRES_PER_DEGREE / METRES_PER_UNIT);
+  }
+
+  // A line per direction of travel between consecutive nodes
+  for (std::vector<OsmWay>::const_iterator wayIt = ways.cbegin(); wayIt != ways.cend(); ++wayIt)
+  {
+    for (size_t i = 0; i + 1 < wayIt->nodes.size(); ++i)
+    {
+      int a = std::lower_bound(nodes.ids.begin(), nodes.ids.end(), wayIt->nodes[i]) - nodes.ids.begin();
+      int b = std::lower_bound(nodes.ids.begin(), nodes.ids.end(), wayIt->nodes[i + 1]) - nodes.ids.begin();
+      if (a == b || std::isnan(nodes.lat[a]) || std::isnan(nodes.lat[b]))
+      {
+        continue;
+      }
+
+      if (wayIt->oneway == 0)
+      {
+        graph.addTwoWayEdge(a, b, wayIt->rank, wayIt->speedLimit);
+      }
+      else if (wayIt->oneway > 0)
+      {
+        graph.addEdge(a, b, wayIt->rank, wayIt->speedLimit);
+      }
+      else
+      {
+        graph.addEdge(b, a, wayIt->rank, wayIt->speedLimit);
+      }
+    }
+  }
+  statistics.ways = ways.size();
+  statistics.nodes = nodes.ids.size();
+  ways.clear();
+  ways.shrink_to_fit();
+
+  NetworkGraphStatistics graphStatistics;
+  if (!graph.write(networkFileName, "Imported from " + pbfFileName, graphStatistics))
+  {
+    return false;
+  }
+  statistics.lines = graphStatistics.lines;
+  statistics.merges = graphStatistics.merges;
+  statistics.yields = graphStatistics.yields;
+  return true;
+}
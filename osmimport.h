@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * OpenStreetMap import
+ *
+ * Converts the highways of an OSM .pbf extract into a network file in the
+ * format of testbane.txt. Every stretch of a way between two consecutive
+ * nodes becomes a NetworkGraph edge per direction of travel, ranked by its
+ * highway class, which decides who merges and who yields where they meet.
+ *
+ * The file is read twice, first for the ways and then for the nodes they
+ * use. Blocks are decoded in parallel, a bounded batch at a time, so memory
+ * use grows with the size of the road network but not of the extract.
+ */
+
+struct OsmWay
+{
+  int64_t id;
+  std::vector<int64_t> nodes;
+  int rank;       // Higher for more important highways
+  int oneway;     // 1 for forwards only, -1 for backwards only, 0 for both ways
+  int speedLimit; // km/h, 0 if not tagged
+};
+
+struct OsmImportStatistics
+{
+  size_t ways;
+  size_t nodes;
+  size_t lines;
+  size_t merges;
+  size_t yields;
+};
+
+bool importOsmPbf(const std::string & pbfFileName,
+                  const std::string & networkFileName,
+                  int threads,
+                  OsmImportStatistics & statistics);
+
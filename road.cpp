@@ -0,0 +1,316 @@
+#include "road.h"
+#include "line.h"
+
+#include <algorithm>
+#include <climits>
+
+Road::Road(Controller * controller, TransportNetwork * transportNetwork,
+           const std::vector<Line *> & lanes)
+  : ControllerUser(controller),
+    m_lanes(lanes),
+    m_laneVehicles(lanes.size()),
+    p_transportNetwork(transportNetwork),
+    m_changeRight(true),
+    m_tickCount(0)
+{
+}
+
+Road::~Road()
+{
+  controller->unregisterUser(this);
+}
+
+const std::vector<Line *> & Road::getLanes() const
+{
+  return m_lanes;
+}
+
+// Add the lane change state to hash, the recent changes in packet ID order
+uint64_t Road::hashState(uint64_t hash) const
+{
+  hash = hashStep(hash, m_changeRight);
+  hash = hashStep(hash, static_cast<uint32_t>(m_tickCount));
+  std::vector<std::pair<PacketId, int> > changes(m_laneChangeTicks.begin(), m_laneChangeTicks.end());
+  std::sort(changes.begin(), changes.end());
+  for (std::vector<std::pair<PacketId, int> >::const_iterator it = changes.cbegin();
+      it != changes.cend(); ++it)
+  {
+    hash = hashStep(hash, it->first);
+    hash = hashStep(hash, static_cast<uint32_t>(it->second));
+  }
+  return hash;
+}
+
+// Use replacement as the lane instead of lane, or drop lane if replacement
+// is NULL, as when the network is edited.
+void Road::replaceLane(Line * lane, Line * replacement)
+{
+  std::vector<Line *>::iterator it = std::find(m_lanes.begin(), m_lanes.end(), lane);
+  if (it == m_lanes.end())
+  {
+    return;
+  }
+  if (replacement != NULL)
+  {
+    *it = replacement;
+  }
+  else
+  {
+    m_lanes.erase(it);
+    m_laneVehicles.resize(m_lanes.size());
+  }
+}
+
+// Position in lane to of a position in lane from, for lanes of unequal length
+static int mapPosition(int position, Line * from, Line * to)
+{
+  return static_cast<int>(static_cast<int64_t>(position) * to->getLength() / from->getLength());
+}
+
+/*
+ * Acceleration of a vehicle following leader, or driving freely if there is
+ * no leader, by the same rule as the car-following in Line::tick0().
+ */
+int Road::followAcceleration(const LaneVehicle & follower, int followerPosition,
+                             const LaneVehicle * leader, int leaderPosition)
+{
+  const VehicleClass & followerClass = VEHICLE_CLASSES[follower.vehicleClass];
+  int freeAcceleration = follower.speed < follower.preferredSpeed
+                       ? followerClass.speedupAcceleration : 0;
+  if (leader == NULL)
+  {
+    return freeAcceleration;
+  }
+
+  const VehicleClass & leaderClass = VEHICLE_CLASSES[leader->vehicleClass];
+  int brakePoint = followerPosition + brakeLength(follower.speed, followerClass.brakeDivider);
+  int leaderBrakePoint = leaderPosition + brakeLength(leader->speed, leaderClass.brakeDivider);
+
+  if ((brakePoint + follower.speed + leader->length) >= leaderBrakePoint)
+  {
+    return -followerClass.brakeAcceleration;
+  }
+  if ((brakePoint + follower.speed + followerClass.speedupAcceleration + leader->length)
+      >= std::max(0, leaderBrakePoint - leaderClass.brakeAcceleration))
+  {
+    return 0;
+  }
+  return freeAcceleration;
+}
+
+// Take in the NOW state of all lanes
+void Road::fillLaneVehicles()
+{
+  for (size_t lane = 0; lane < m_lanes.size(); ++lane)
+  {
+    Line * line = m_lanes[lane];
+    std::vector<LaneVehicle> & laneVehicles = m_laneVehicles[lane];
+    laneVehicles.clear();
+
+    const std::vector<PacketId> & packets = line->getPackets();
+    for (std::vector<PacketId>::const_iterator it = packets.cbegin();
+        it != packets.cend(); ++it)
+    {
+      TransportNetworkPacket * packet = p_transportNetwork->getPacket(*it);
+      const TransportNetworkPacketMutableData & data = packet->mutableData.NOW();
+      const VehicleClass & vehicleClass = VEHICLE_CLASSES[packet->vehicleClass];
+
+      LaneVehicle vehicle;
+      vehicle.packetId = *it;
+      vehicle.position = data.positionAtLine;
+      vehicle.speed = data.speed;
+      vehicle.preferredSpeed = packet->preferredSpeed;
+      vehicle.length = packet->length;
+      vehicle.vehicleClass = packet->vehicleClass;
+
+      // Packets searching beyond their line, or yielding, keep their lane,
+      // as do packets just in, which may have others entering right behind.
+      int searchPoint = data.positionAtLine
+                      + brakeLength(data.speed, vehicleClass.brakeDivider)
+                      + (2 * data.speed) + (2 * packet->length);
+      vehicle.mayChangeLanes = searchPoint <= line->getLength()
+                            && data.positionAtLine >= SPEED + (2 * packet->length)
+                            && data.packetIDsToYieldFor.empty()
+                            && !m_laneChangeTicks.count(*it);
+
+      laneVehicles.push_back(vehicle);
+    }
+  }
+}
+
+// Index of the first vehicle in lane behind position
+int Road::findFollower(int lane, int position)
+{
+  const std::vector<LaneVehicle> & laneVehicles = m_laneVehicles[lane];
+  int low = 0;
+  int high = laneVehicles.size();
+  while (low < high)
+  {
+    int middle = (low + high) / 2;
+    if (laneVehicles[middle].position >= position)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/*
+ * MOBIL incentive for vehicle index in fromLane to change to toLane
+ *
+ * Positive if the vehicle should change lanes. INT_MIN if the change is
+ * unsafe: the gap is too short, the vehicle or its new follower would
+ * have to brake, or toLane is closed.
+ */
+int Road::changeIncentive(int fromLane, int index, int toLane)
+{
+  const std::vector<LaneVehicle> & fromVehicles = m_laneVehicles[fromLane];
+  const std::vector<LaneVehicle> & toVehicles = m_laneVehicles[toLane];
+  const LaneVehicle & vehicle = fromVehicles[index];
+  if (m_lanes[toLane]->isClosed())
+  {
+    return INT_MIN;
+  }
+
+  const LaneVehicle * oldLeader = index > 0 ? &fromVehicles[index - 1] : NULL;
+  const LaneVehicle * oldFollower = index + 1 < static_cast<int>(fromVehicles.size())
+                                  ? &fromVehicles[index + 1] : NULL;
+
+  int position = mapPosition(vehicle.position, m_lanes[fromLane], m_lanes[toLane]);
+  int followerIndex = findFollower(toLane, position);
+  const LaneVehicle * newLeader = followerIndex > 0 ? &toVehicles[followerIndex - 1] : NULL;
+  const LaneVehicle * newFollower = followerIndex < static_cast<int>(toVehicles.size())
+                                  ? &toVehicles[followerIndex] : NULL;
+
+  // Room in the gap
+  if ((newLeader != NULL && newLeader->position - newLeader->length < position)
+      || (newFollower != NULL && position - vehicle.length < newFollower->position))
+  {
+    return INT_MIN;
+  }
+
+  // Safety: the change must not make anyone brake
+  int newAcceleration = followAcceleration(vehicle, position, newLeader,
+                                           newLeader ? newLeader->position : 0);
+  int newFollowerAcceleration = 0;
+  if (newFollower != NULL)
+  {
+    newFollowerAcceleration = followAcceleration(*newFollower, newFollower->position,
+                                                 &vehicle, position);
+  }
+  if (newAcceleration < 0 || newFollowerAcceleration < 0)
+  {
+    return INT_MIN;
+  }
+
+  int acceleration = followAcceleration(vehicle, vehicle.position, oldLeader,
+                                        oldLeader ? oldLeader->position : 0);
+
+  // What the followers in both lanes gain or lose
+  int followersGain = 0;
+  if (newFollower != NULL)
+  {
+    followersGain += newFollowerAcceleration
+                   - followAcceleration(*newFollower, newFollower->position, newLeader,
+                                        newLeader ? newLeader->position : 0);
+  }
+  if (oldFollower != NULL)
+  {
+    followersGain += followAcceleration(*oldFollower, oldFollower->position, oldLeader,
+                                        oldLeader ? oldLeader->position : 0)
+                   - followAcceleration(*oldFollower, oldFollower->position,
+                                        &vehicle, vehicle.position);
+  }
+
+  int bias = toLane < fromLane ? KEEP_RIGHT_BIAS : -KEEP_RIGHT_BIAS;
+  if (m_lanes[fromLane]->isClosed())
+  {
+    bias += CLOSED_LANE_BIAS;
+  }
+  return newAcceleration - acceleration
+       + (LANE_CHANGE_POLITENESS * followersGain) / 100
+       + bias - LANE_CHANGE_THRESHOLD;
+}
+
+/*
+ * Move a packet to the neighbouring lane, in the next state, at the
+ * position it reached in tick 0. Fails if it has left its line, or if it
+ * would overlap a packet already moved into the new lane.
+ */
+bool Road::changeLane(int fromLane, int index, int toLane)
+{
+  Line * from = m_lanes[fromLane];
+  Line * to = m_lanes[toLane];
+  PacketId packetId = m_laneVehicles[fromLane][index].packetId;
+  TransportNetworkPacketMutableData & data = p_transportNetwork->getPacket(packetId)->mutableData.THEN();
+
+  if (data.line != from || data.positionAtLine >= from->getLength())
+  {
+    return false;
+  }
+
+  int position = data.positionAtLine;
+  data.positionAtLine = mapPosition(position, from, to);
+  if (!to->insertPacket(packetId))
+  {
+    data.positionAtLine = position;
+    return false;
+  }
+
+  from->releasePacket(packetId);
+  data.line = to;
+  data.fillRoute(to);
+  m_laneChangeTicks[packetId] = m_tickCount;
+  return true;
+}
+
+void Road::tick(int tickType)
+{
+  if (tickType != LANE_CHANGE_TICK)
+  {
+    return;
+  }
+
+  // Forget lane changes that no longer hold packets in their lane
+  for (std::unordered_map<PacketId, int>::iterator it = m_laneChangeTicks.begin();
+      it != m_laneChangeTicks.end(); )
+  {
+    if (m_tickCount - it->second >= LANE_CHANGE_HOLD_TIME)
+    {
+      it = m_laneChangeTicks.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+
+  fillLaneVehicles();
+
+  int step = m_changeRight ? -1 : 1;
+  for (int fromLane = 0; fromLane < static_cast<int>(m_lanes.size()); ++fromLane)
+  {
+    int toLane = fromLane + step;
+    if (toLane < 0 || toLane >= static_cast<int>(m_lanes.size()))
+    {
+      continue;
+    }
+
+    for (int i = 0; i < static_cast<int>(m_laneVehicles[fromLane].size()); ++i)
+    {
+      if (m_laneVehicles[fromLane][i].mayChangeLanes
+          && changeIncentive(fromLane, i, toLane) > 0)
+      {
+        changeLane(fromLane, i, toLane);
+      }
+    }
+  }
+
+  m_changeRight = !m_changeRight;
+  ++m_tickCount;
+}
+
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "controller.h"
+#include "controlleruser.h"
+#include "line.h"
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+// Tick type for lane changes; register it between tick types 0 and 1.
+const int32_t LANE_CHANGE_TICK = 2;
+
+const int LANE_CHANGE_POLITENESS = 30;  // Percent of the neighbours' gain or loss counted
+const int LANE_CHANGE_THRESHOLD = 200;  // mm/s^2 of gain needed to change lanes
+const int KEEP_RIGHT_BIAS = 500;        // mm/s^2 in favour of the lane to the right
+const int LANE_CHANGE_HOLD_TIME = 10;   // Ticks to stay in a lane after changing to it
+const int CLOSED_LANE_BIAS = 2000;     // mm/s^2 in favour of leaving a closed lane
+
+/*
+ * Multi-lane road
+ *
+ * A group of parallel Lines, the rightmost lane first. In LANE_CHANGE_TICK,
+ * after the lines have moved their packets in tick 0, every packet
+ * considers moving one lane over, by the MOBIL model: it changes lanes if
+ * that gains it more acceleration than it costs the packets behind it, and
+ * the new follower would not have to brake. Lanes change to the right on
+ * even ticks and to the left on odd ticks, so no two packets from either
+ * side compete for the same gap. The speed actions only tell braking,
+ * keeping and gaining speed apart, so a packet that has changed lanes stays
+ * in its new lane for LANE_CHANGE_HOLD_TIME, rather than changing back as
+ * soon as the old lane is as good. Closed lanes take no packets, and the
+ * packets in them are biased towards leaving them.
+ *
+ * Gaps are found by binary search in per-lane arrays of the NOW state,
+ * front first, and never by searching beyond the road's lines. Packets
+ * close to the end of their line stay in their lane, as they are already
+ * searching the lines ahead.
+ */
+class Road : public ControllerUser
+{
+  private:
+    struct LaneVehicle
+    {
+      PacketId packetId;
+      int position;
+      int speed;
+      int preferredSpeed;
+      int length;
+      unsigned char vehicleClass;
+      bool mayChangeLanes;
+    };
+
+    std::vector<Line *> m_lanes;
+    std::vector<std::vector<LaneVehicle> > m_laneVehicles; // Per lane, front first
+    TransportNetwork * p_transportNetwork;
+    bool m_changeRight;
+    int m_tickCount;
+    std::unordered_map<PacketId, int> m_laneChangeTicks; // Recent changes, by packet ID
+
+    static int followAcceleration(const LaneVehicle & follower, int followerPosition,
+                                  const LaneVehicle * leader, int leaderPosition);
+    void fillLaneVehicles();
+    int findFollower(int lane, int position);
+    int changeIncentive(int fromLane, int index, int toLane);
+    bool changeLane(int fromLane, int index, int toLane);
+
+  public:
+    Road(Controller * controller, TransportNetwork * transportNetwork,
+         const std::vector<Line *> & lanes);
+    ~Road();
+
+    const std::vector<Line *> & getLanes() const;
+    void replaceLane(Line * lane, Line * replacement);
+    uint64_t hashState(uint64_t hash) const;
+
+    virtual void tick(int tickType);
+};
+
@@ -0,0 +1,304 @@
+#include "scenariorunner.h"
+#include "controller.h"
+#include "road.h"
+#include "signaloptimiser.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Close the scenario's lines, and run it on from the network's state,
+// retiming the signals if it asks for it
+static void runTicks(Controller & controller, TransportNetwork & transportNetwork,
+                     const NetworkTopology & topology, const Scenario & scenario,
+                     ScenarioResult & result)
+{
+  // The network was built from the topology, and has its lines in its order
+  const std::vector<Line *> & lines = transportNetwork.getLines();
+  std::vector<int> positions(topology.order.size());
+  for (size_t i = 0; i < topology.order.size(); ++i)
+  {
+    positions[topology.order[i]] = i;
+  }
+  for (std::vector<int>::const_iterator it = scenario.closedLines.cbegin();
+      it != scenario.closedLines.cend(); ++it)
+  {
+    if (*it >= 0 && *it < static_cast<int>(positions.size()))
+    {
+      transportNetwork.setLineClosed(lines[positions[*it]], true);
+    }
+  }
+  SignalOptimiser signalOptimiser(&controller, &transportNetwork, scenario.optimiseSignals
+                                  ? transportNetwork.getSignals() : std::vector<TrafficSignal *>());
+
+  unsigned int passedBefore = 0;
+  for (std::vector<Line *>::const_iterator it = lines.cbegin(); it != lines.cend(); ++it)
+  {
+    passedBefore += (*it)->getPassedPackets();
+  }
+  result.initialPackets = transportNetwork.getNumberOfPackets();
+  transportNetwork.resetTripStatistics();
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int tick = 0; tick < scenario.ticks; ++tick)
+  {
+    controller.tick();
+  }
+  result.milliseconds = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start).count();
+
+  result.packets = transportNetwork.getNumberOfPackets();
+  result.passedPackets = 0;
+  for (std::vector<Line *>::const_iterator it = lines.cbegin(); it != lines.cend(); ++it)
+  {
+    result.passedPackets += (*it)->getPassedPackets();
+  }
+  result.passedPackets -= passedBefore;
+  result.trips = transportNetwork.getTripStatistics();
+}
+
+static void registerTickTypes(Controller & controller)
+{
+  controller.registerTickType(0);
+  controller.registerTickType(LANE_CHANGE_TICK);
+  controller.registerTickType(1);
+}
+
+// Build and run one scenario on the calling thread
+ScenarioResult runScenario(const NetworkTopology & topology, const Scenario & scenario)
+{
+  seedRandom(scenario.seed);
+
+  Controller controller;
+  registerTickTypes(controller);
+  TransportNetwork transportNetwork(&controller);
+  transportNetwork.setDemand(scenario.demand);
+  transportNetwork.build(topology);
+
+  ScenarioResult result;
+  runTicks(controller, transportNetwork, topology, scenario, result);
+  return result;
+}
+
+// Run all the scenarios, each thread taking the next one not yet started
+void runScenarios(const NetworkTopology & topology, const std::vector<Scenario> & scenarios,
+                  int threads, std::vector<ScenarioResult> & results)
+{
+  results.resize(scenarios.size());
+  std::atomic<size_t> nextScenario(0);
+  std::vector<std::thread> workers;
+  int workerCount = std::max(1, std::min<int>(threads, scenarios.size()));
+  for (int i = 0; i < workerCount; ++i)
+  {
+    workers.push_back(std::thread([&]()
+    {
+      for (size_t scenario = nextScenario++; scenario < scenarios.size(); scenario = nextScenario++)
+      {
+        results[scenario] = runScenario(topology, scenarios[scenario]);
+      }
+    }));
+  }
+  for (std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it)
+  {
+    it->join();
+  }
+}
+
+static void writeResult(std::ostream & out, const ScenarioResult & result)
+{
+  std::streamsize precision = out.precision(17);
+  out << result.milliseconds << " " << result.initialPackets << " " << result.packets
+      << " " << result.passedPackets << std::endl;
+  out.precision(precision);
+  result.trips.write(out);
+}
+
+static bool readResult(std::istream & in, ScenarioResult & result)
+{
+  return (in >> result.milliseconds >> result.initialPackets >> result.packets
+             >> result.passedPackets)
+         && result.trips.read(in);
+}
+
+// Write all of text to a file descriptor
+static bool writeAll(int fileDescriptor, const std::string & text)
+{
+  for (size_t written = 0; written < text.size(); )
+  {
+    ssize_t count = write(fileDescriptor, text.data() + written, text.size() - written);
+    if (count < 0 && errno != EINTR)
+    {
+      return false;
+    }
+    written += std::max<ssize_t>(count, 0);
+  }
+  return true;
+}
+
+// Read a file descriptor to its end
+static std::string readAll(int fileDescriptor)
+{
+  std::string text;
+  char buffer[4096];
+  for (;;)
+  {
+    ssize_t count = read(fileDescriptor, buffer, sizeof(buffer));
+    if (count < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (count <= 0)
+    {
+      break;
+    }
+    text.append(buffer, count);
+  }
+  return text;
+}
+
+// A forked scenario, and the pipe it reports back through
+struct Branch
+{
+  size_t scenario;
+  pid_t pid;
+  int pipe;
+};
+
+// Wait for a branch to finish, and read its result
+static bool finishBranch(const Branch & branch, std::vector<ScenarioResult> & results)
+{
+  std::istringstream text(readAll(branch.pipe));
+  close(branch.pipe);
+  int status;
+  while (waitpid(branch.pid, &status, 0) < 0 && errno == EINTR)
+  {
+  }
+  if (!readResult(text, results[branch.scenario]))
+  {
+    std::cerr << "Scenario " << branch.scenario << " failed" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Run the scenarios as branches of one warmed up simulation
+ *
+ * The simulation is built with warmupDemand and run for warmupTicks with
+ * warmupSeed, then the process forks once per scenario, up to threads at
+ * a time. Every branch starts out sharing all the memory of the warm state
+ * with the others, copy on write, and reseeds, closes its lines and runs
+ * on by itself, sending its result back through a pipe. Only trips completed
+ * in the branch count. False if a branch could not be run.
+ */
+bool runEnsemble(const NetworkTopology & topology, unsigned int warmupSeed, int warmupTicks,
+                 const TrafficDemand & warmupDemand, const std::vector<Scenario> & scenarios,
+                 int threads, std::vector<ScenarioResult> & results)
+{
+  results.assign(scenarios.size(), ScenarioResult());
+
+  seedRandom(warmupSeed);
+  Controller controller;
+  registerTickTypes(controller);
+  TransportNetwork transportNetwork(&controller);
+  transportNetwork.setDemand(warmupDemand);
+  transportNetwork.build(topology);
+  for (int tick = 0; tick < warmupTicks; ++tick)
+  {
+    controller.tick();
+  }
+
+  // Buffered output would be written again by every branch
+  std::cout.flush();
+  std::cerr.flush();
+  fflush(NULL);
+
+  bool success = true;
+  std::vector<Branch> running;
+  for (size_t i = 0; i < scenarios.size() || !running.empty(); )
+  {
+    if (i < scenarios.size() && static_cast<int>(running.size()) < std::max(1, threads))
+    {
+      int fileDescriptors[2];
+      if (pipe(fileDescriptors) != 0)
+      {
+        std::cerr << "pipe: " << strerror(errno) << std::endl;
+        success = false;
+        break;
+      }
+      pid_t pid = fork();
+      if (pid < 0)
+      {
+        std::cerr << "fork: " << strerror(errno) << std::endl;
+        close(fileDescriptors[0]);
+        close(fileDescriptors[1]);
+        success = false;
+        break;
+      }
+      if (pid == 0)
+      {
+        close(fileDescriptors[0]);
+        seedRandom(scenarios[i].seed);
+        ScenarioResult result;
+        runTicks(controller, transportNetwork, topology, scenarios[i], result);
+        std::ostringstream text;
+        writeResult(text, result);
+        bool written = writeAll(fileDescriptors[1], text.str());
+        // Leave without tearing down the copy of the warm state
+        _exit(written ? 0 : 1);
+      }
+      close(fileDescriptors[1]);
+      Branch branch = {i, pid, fileDescriptors[0]};
+      running.push_back(branch);
+      ++i;
+      continue;
+    }
+
+    success = finishBranch(running.front(), results) && success;
+    running.erase(running.begin());
+  }
+
+  for (std::vector<Branch>::const_iterator it = running.cbegin(); it != running.cend(); ++it)
+  {
+    success = finishBranch(*it, results) && success;
+  }
+  return success;
+}
+
+// One line per scenario, then the trips of all of them together
+void writeReport(std::ostream & out, const std::vector<Scenario> & scenarios,
+                 const std::vector<ScenarioResult> & results)
+{
+  char line[200];
+  snprintf(line, sizeof(line), "%-16s %10s %6s %9s %9s %9s %10s %7s %7s %7s",
+      "scenario", "seed", "ticks", "ms/tick", "packets", "left", "passed", "trips",
+      "p50 s", "p90 s");
+  out << line << std::endl;
+
+  TripStatistics allTrips;
+  for (size_t i = 0; i < scenarios.size() && i < results.size(); ++i)
+  {
+    const Scenario & scenario = scenarios[i];
+    const ScenarioResult & result = results[i];
+    snprintf(line, sizeof(line), "%-16s %10u %6d %9.2f %9d %9d %10u %7llu %7.0f %7.0f",
+        scenario.name.c_str(), scenario.seed, scenario.ticks,
+        scenario.ticks > 0 ? result.milliseconds / scenario.ticks : 0.0,
+        result.initialPackets, result.packets, result.passedPackets,
+        static_cast<unsigned long long>(result.trips.getTrips()),
+        result.trips.tripTime.getQuantile(0.5), result.trips.tripTime.getQuantile(0.9));
+    out << line << std::endl;
+    allTrips.merge(result.trips);
+  }
+
+  out << std::endl << "All scenarios" << std::endl;
+  allTrips.writeSummary(out);
+}
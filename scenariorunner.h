@@ -0,0 +1,52 @@
+#pragma once
+
+#include "line.h"
+#include "tripstatistics.h"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * Batch runs of independent simulations
+ *
+ * Every scenario gets its own Controller and TransportNetwork, built from
+ * one shared NetworkTopology that is only read, with its own demand, and
+ * runs start to end on one thread. Up to one scenario per thread runs at a time, so memory grows
+ * with the number of threads, not of scenarios. The vehicles and the route
+ * choices of a scenario only depend on its seed, not on the thread it runs
+ * on or what runs next to it.
+ *
+ * An ensemble instead forks its scenarios from one simulation warmed up
+ * in this process, so the warm-up is run once and not per scenario. Its
+ * vehicles are those of the warm-up, so the scenarios' demands are not
+ * used.
+ */
+
+struct Scenario
+{
+  std::string name;
+  unsigned int seed;
+  int ticks;
+  TrafficDemand demand;          // Vehicles the lines start out with
+  std::vector<int> closedLines; // Topology line indexes, closed as it starts
+  bool optimiseSignals;         // Retime the signals to their queues as it runs
+};
+
+struct ScenarioResult
+{
+  double milliseconds;         // Ticking only, not building the network
+  int initialPackets;          // When the scenario started
+  int packets;                 // Left at the end
+  unsigned int passedPackets;  // Packets leaving lines, summed over the lines
+  TripStatistics trips;
+};
+
+ScenarioResult runScenario(const NetworkTopology & topology, const Scenario & scenario);
+void runScenarios(const NetworkTopology & topology, const std::vector<Scenario> & scenarios,
+                  int threads, std::vector<ScenarioResult> & results);
+bool runEnsemble(const NetworkTopology & topology, unsigned int warmupSeed, int warmupTicks,
+                 const TrafficDemand & warmupDemand, const std::vector<Scenario> & scenarios,
+                 int threads, std::vector<ScenarioResult> & results);
+void writeReport(std::ostream & out, const std::vector<Scenario> & scenarios,
+                 const std::vector<ScenarioResult> & results);
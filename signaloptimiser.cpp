@@ -0,0 +1,345 @@
+#include "signaloptimiser.h"
+#include "trafficsignal.h"
+#include "line.h"
+#include "journal.h"
+
+#include <algorithm>
+#include <map>
+
+SignalOptimiser::SignalOptimiser(Controller * controller, TransportNetwork * transportNetwork,
+                                 const std::vector<TrafficSignal *> & signals)
+  : ControllerUser(controller),
+    m_signals(signals),
+    p_transportNetwork(transportNetwork),
+    m_sampleCount(0),
+    m_throughput(0),
+    m_baselineThroughput(-1),
+    m_snapshotReady(false),
+    m_resultReady(false),
+    m_stop(false),
+    p_journal(NULL)
+{
+  // The plans the signals start out with
+  for (std::vector<TrafficSignal *>::const_iterator signalIt = m_signals.cbegin();
+      signalIt != m_signals.cend(); ++signalIt)
+  {
+    std::vector<int> greenTimes;
+    int totalGreenTime = 0;
+
+    const std::vector<SignalPhase> & phases = (*signalIt)->getPhases();
+    for (std::vector<SignalPhase>::const_iterator phaseIt = phases.cbegin();
+        phaseIt != phases.cend(); ++phaseIt)
+    {
+      greenTimes.push_back(phaseIt->greenTime);
+      totalGreenTime += phaseIt->greenTime;
+    }
+
+    m_greenTimes.push_back(greenTimes);
+    m_totalGreenTimes.push_back(totalGreenTime);
+  }
+
+  indexLines();
+
+  if (!m_signals.empty())
+  {
+    m_worker = std::thread(&SignalOptimiser::work, this);
+  }
+}
+
+/*
+ * Index the lines the signals control, and the lines those feed, as the
+ * network is now, and start sampling them afresh
+ */
+void SignalOptimiser::indexLines()
+{
+  std::map<Line *, int> lineIndices;
+  m_lines.clear();
+  m_lineOuts.clear();
+  m_phaseLines.clear();
+
+  // Controlled lines
+  for (std::vector<TrafficSignal *>::const_iterator signalIt = m_signals.cbegin();
+      signalIt != m_signals.cend(); ++signalIt)
+  {
+    const std::vector<Line *> & lines = (*signalIt)->getLines();
+    for (std::vector<Line *>::const_iterator lineIt = lines.cbegin();
+        lineIt != lines.cend(); ++lineIt)
+    {
+      if (*lineIt != NULL && !lineIndices.count(*lineIt))
+      {
+        lineIndices[*lineIt] = m_lines.size();
+        m_lines.push_back(*lineIt);
+      }
+    }
+  }
+  m_controlledLineCount = m_lines.size();
+
+  // The lines they feed
+  m_lineOuts.resize(m_controlledLineCount);
+  for (size_t i = 0; i < m_controlledLineCount; ++i)
+  {
+    std::vector<Line *> outs = m_lines[i]->getOut();
+    for (std::vector<Line *>::const_iterator outIt = outs.cbegin();
+        outIt != outs.cend(); ++outIt)
+    {
+      if (!lineIndices.count(*outIt))
+      {
+        lineIndices[*outIt] = m_lines.size();
+        m_lines.push_back(*outIt);
+      }
+      m_lineOuts[i].push_back(lineIndices[*outIt]);
+    }
+  }
+  m_lineOuts.resize(m_lines.size());
+
+  // The green lines of every phase
+  for (std::vector<TrafficSignal *>::const_iterator signalIt = m_signals.cbegin();
+      signalIt != m_signals.cend(); ++signalIt)
+  {
+    std::vector<std::vector<int> > phaseLines;
+    const std::vector<SignalPhase> & phases = (*signalIt)->getPhases();
+    for (std::vector<SignalPhase>::const_iterator phaseIt = phases.cbegin();
+        phaseIt != phases.cend(); ++phaseIt)
+    {
+      std::vector<int> greenLines;
+      for (std::vector<Line *>::const_iterator lineIt = phaseIt->greenLines.cbegin();
+          lineIt != phaseIt->greenLines.cend(); ++lineIt)
+      {
+        if (lineIndices.count(*lineIt))
+        {
+          greenLines.push_back(lineIndices[*lineIt]);
+        }
+      }
+      phaseLines.push_back(greenLines);
+    }
+    m_phaseLines.push_back(phaseLines);
+  }
+
+  m_editCount = p_transportNetwork != NULL ? p_transportNetwork->getEditCount() : 0;
+  m_queueSums.assign(m_lines.size(), 0);
+  m_sampleCount = 0;
+  m_lastPassedPackets = passedPackets();
+}
+
+SignalOptimiser::~SignalOptimiser()
+{
+  controller->unregisterUser(this);
+
+  if (m_worker.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_wake.notify_one();
+    m_worker.join();
+  }
+}
+
+// Packets that have left the controlled lines so far
+unsigned int SignalOptimiser::passedPackets()
+{
+  unsigned int passed = 0;
+  for (size_t i = 0; i < m_controlledLineCount; ++i)
+  {
+    passed += m_lines[i]->getPassedPackets();
+  }
+  return passed;
+}
+
+// Packets through the signals in the last interval
+int SignalOptimiser::getThroughput()
+{
+  return m_throughput;
+}
+
+// Packets through the signals in the first interval, before any retiming,
+// or -1 if it has not passed yet.
+int SignalOptimiser::getBaselineThroughput()
+{
+  return m_baselineThroughput;
+}
+
+// Record the retimings from now on, as when they are applied depends on
+// the worker thread
+void SignalOptimiser::setJournal(JournalRecorder * journal)
+{
+  p_journal = journal;
+}
+
+void SignalOptimiser::tick(int tickType)
+{
+  if (tickType != 1 || m_signals.empty())
+  {
+    return;
+  }
+
+  applyResult();
+
+  if (p_transportNetwork != NULL && p_transportNetwork->getEditCount() != m_editCount)
+  {
+    indexLines();
+  }
+
+  for (size_t i = 0; i < m_lines.size(); ++i)
+  {
+    m_queueSums[i] += m_lines[i]->getQueueLength();
+  }
+  ++m_sampleCount;
+
+  if (m_sampleCount >= SIGNAL_OPTIMISER_INTERVAL)
+  {
+    unsigned int passed = passedPackets();
+    m_throughput = passed - m_lastPassedPackets;
+    m_lastPassedPackets = passed;
+    if (m_baselineThroughput < 0)
+    {
+      m_baselineThroughput = m_throughput;
+    }
+
+    publishSnapshot();
+    m_queueSums.assign(m_lines.size(), 0);
+    m_sampleCount = 0;
+  }
+}
+
+// Hand the average queues to the worker, unless it is busy
+void SignalOptimiser::publishSnapshot()
+{
+  std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+  if (!lock.owns_lock() || m_snapshotReady)
+  {
+    return;
+  }
+
+  m_snapshot.queues.resize(m_lines.size());
+  for (size_t i = 0; i < m_lines.size(); ++i)
+  {
+    m_snapshot.queues[i] = static_cast<float>(m_queueSums[i]) / m_sampleCount;
+  }
+  m_snapshot.lineOuts = m_lineOuts;
+  m_snapshot.phaseLines = m_phaseLines;
+  m_snapshotReady = true;
+  lock.unlock();
+  m_wake.notify_one();
+}
+
+// Retime the signals, if the worker has finished a new plan
+void SignalOptimiser::applyResult()
+{
+  std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+  if (!lock.owns_lock() || !m_resultReady)
+  {
+    return;
+  }
+
+  for (size_t signal = 0; signal < m_signals.size(); ++signal)
+  {
+    const std::vector<SignalPhase> & phases = m_signals[signal]->getPhases();
+    for (size_t phase = 0; phase < phases.size(); ++phase)
+    {
+      if (p_journal != NULL)
+      {
+        p_journal->recordPhaseTimes(m_signals[signal], phase, m_result[signal][phase],
+                                    phases[phase].clearanceTime);
+      }
+      m_signals[signal]->setPhaseTimes(phase, m_result[signal][phase],
+                                       phases[phase].clearanceTime);
+    }
+  }
+  m_resultReady = false;
+}
+
+// Worker thread
+void SignalOptimiser::work()
+{
+  SignalSnapshot snapshot;
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true)
+  {
+    while (!m_stop && !m_snapshotReady)
+    {
+      m_wake.wait(lock);
+    }
+    if (m_stop)
+    {
+      return;
+    }
+
+    std::swap(snapshot, m_snapshot);
+    m_snapshotReady = false;
+    lock.unlock();
+
+    optimise(snapshot);
+
+    lock.lock();
+    m_result = m_greenTimes;
+    m_resultReady = true;
+  }
+}
+
+/*
+ * Max-pressure split of each signal's green time
+ *
+ * The pressure of a phase is the sum, over its green lines, of the queue on
+ * the line minus the average queue on the lines it feeds. Every phase keeps
+ * MINIMUM_GREEN_TIME, and the rest of the cycle's green time is split in
+ * proportion to the pressures. The plan moves halfway towards that split
+ * each interval, so a single noisy sample does not upset it.
+ */
+void SignalOptimiser::optimise(const SignalSnapshot & snapshot)
+{
+  const std::vector<float> & queues = snapshot.queues;
+  for (size_t signal = 0; signal < snapshot.phaseLines.size(); ++signal)
+  {
+    const std::vector<std::vector<int> > & phaseLines = snapshot.phaseLines[signal];
+    int phaseCount = phaseLines.size();
+    int spareGreenTime = m_totalGreenTimes[signal] - phaseCount * MINIMUM_GREEN_TIME;
+    if (spareGreenTime <= 0)
+    {
+      continue;
+    }
+
+    std::vector<float> pressures(phaseCount, 0.0f);
+    float totalPressure = 0.0f;
+    for (int phase = 0; phase < phaseCount; ++phase)
+    {
+      float pressure = 0.0f;
+      for (std::vector<int>::const_iterator lineIt = phaseLines[phase].cbegin();
+          lineIt != phaseLines[phase].cend(); ++lineIt)
+      {
+        const std::vector<int> & outs = snapshot.lineOuts[*lineIt];
+        float outQueue = 0.0f;
+        for (std::vector<int>::const_iterator outIt = outs.cbegin();
+            outIt != outs.cend(); ++outIt)
+        {
+          outQueue += queues[*outIt];
+        }
+        if (!outs.empty())
+        {
+          outQueue /= outs.size();
+        }
+        pressure += queues[*lineIt] - outQueue;
+      }
+      // Keep every phase in the running, even with no queue at all
+      pressures[phase] = std::max(pressure, 0.0f) + 1.0f;
+      totalPressure += pressures[phase];
+    }
+
+    std::vector<int> & greenTimes = m_greenTimes[signal];
+    int assigned = 0;
+    for (int phase = 0; phase < phaseCount; ++phase)
+    {
+      int target = MINIMUM_GREEN_TIME
+        + static_cast<int>(spareGreenTime * pressures[phase] / totalPressure);
+      greenTimes[phase] = std::max(MINIMUM_GREEN_TIME, (greenTimes[phase] + target) / 2);
+      assigned += greenTimes[phase];
+    }
+
+    // Give any rounding remainder to the phase under most pressure
+    int mostPressured = std::max_element(pressures.begin(), pressures.end()) - pressures.begin();
+    greenTimes[mostPressured] += m_totalGreenTimes[signal] - assigned;
+  }
+}
+
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "controller.h"
+#include "controlleruser.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Line; // Forward declaration
+class TrafficSignal; // Forward declaration
+class TransportNetwork; // Forward declaration
+class JournalRecorder; // Forward declaration
+
+const int SIGNAL_OPTIMISER_INTERVAL = 120; // Ticks between retimings
+const int MINIMUM_GREEN_TIME = 5;          // Ticks
+
+// What the worker retimes the signals from: the average queues, and the
+// lines they were sampled on as indexed at the time
+struct SignalSnapshot
+{
+  std::vector<float> queues;                               // Per line
+  std::vector<std::vector<int> > lineOuts;                 // Indices of the lines fed, per line
+  std::vector<std::vector<std::vector<int> > > phaseLines; // Green line indices, per signal and phase
+};
+
+/*
+ * Adaptive signal control
+ *
+ * Samples the queues on the lines around a set of TrafficSignals every tick,
+ * and once per interval publishes their averages as a snapshot for a
+ * background thread. The thread splits the green time of each signal's cycle
+ * between its phases by max-pressure: the queue on the green lines minus the
+ * queue on the lines they feed. The new green times are applied in a later
+ * tick. The simulation never waits for the thread; a snapshot published while
+ * the thread is busy is dropped.
+ *
+ * The lines are indexed again after every edit of the network, as splitting
+ * or removing a line hands its signal to other lines, and the samples of the
+ * interval so far are dropped. The snapshot carries the indexes it was
+ * sampled with, so the thread never looks at the lines themselves.
+ */
+class SignalOptimiser : public ControllerUser
+{
+  private:
+    std::vector<TrafficSignal *> m_signals;
+    TransportNetwork * p_transportNetwork;
+    unsigned int m_editCount;                     // The network's, when the lines were indexed
+    std::vector<Line *> m_lines;                  // Controlled lines first, then the lines they feed
+    size_t m_controlledLineCount;
+    std::vector<std::vector<int> > m_lineOuts;    // Indices into m_lines, per m_lines
+    std::vector<std::vector<std::vector<int> > > m_phaseLines; // Green line indices, per signal and phase
+    std::vector<int> m_totalGreenTimes;           // Per signal, kept constant
+    std::vector<std::vector<int> > m_greenTimes;  // Worker's current plan
+
+    // Sampled on the simulation thread
+    std::vector<int> m_queueSums;
+    int m_sampleCount;
+    unsigned int m_lastPassedPackets;
+    int m_throughput;         // Packets through the signals in the last interval
+    int m_baselineThroughput; // Ditto, in the first (fixed time) interval
+
+    // Shared with the worker, guarded by m_mutex
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    SignalSnapshot m_snapshot;
+    bool m_snapshotReady;
+    std::vector<std::vector<int> > m_result;
+    bool m_resultReady;
+    bool m_stop;
+
+    std::thread m_worker;
+
+    JournalRecorder * p_journal;
+
+    void indexLines();
+    unsigned int passedPackets();
+    void publishSnapshot();
+    void applyResult();
+    void work();
+    void optimise(const SignalSnapshot & snapshot);
+
+  public:
+    SignalOptimiser(Controller * controller, TransportNetwork * transportNetwork,
+                    const std::vector<TrafficSignal *> & signals);
+    ~SignalOptimiser();
+
+    int getThroughput();
+    int getBaselineThroughput();
+    void setJournal(JournalRecorder * journal);
+
+    virtual void tick(int tickType);
+};
+
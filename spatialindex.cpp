@@ -0,0 +1,156 @@
+#include "spatialindex.h"
+#include "line.h"
+
+#include <algorithm>
+#include <cmath>
+
+const float DEFAULT_CELL_SIZE = 1.0f; // Network file units, until built
+const float MIN_CELL_SIZE = 0.01f;
+
+/*
+ * Distance in the x-y plane from a point to the nearest point on a line,
+ * and, if fraction is given, how far along the line that point is, from 0
+ * at its beginning to 1 at its end
+ */
+float distanceToLine(Line * line, float x, float y, float * fraction)
+{
+  Coordinates begin = line->getBeginPoint();
+  Coordinates end = line->getEndPoint();
+  float dx = end.x - begin.x;
+  float dy = end.y - begin.y;
+  float lengthSquared = dx * dx + dy * dy;
+
+  float t = 0.0f;
+  if (lengthSquared > 0.0f)
+  {
+    t = ((x - begin.x) * dx + (y - begin.y) * dy) / lengthSquared;
+    t = std::max(0.0f, std::min(1.0f, t));
+  }
+  if (fraction != NULL)
+  {
+    *fraction = t;
+  }
+  return hypot(begin.x + t * dx - x, begin.y + t * dy - y);
+}
+
+SpatialIndex::SpatialIndex()
+{
+  m_cellSize = DEFAULT_CELL_SIZE;
+}
+
+int SpatialIndex::cellOf(float coordinate) const
+{
+  return static_cast<int>(floor(coordinate / m_cellSize));
+}
+
+uint64_t SpatialIndex::cellKey(int cellX, int cellY)
+{
+  return (static_cast<uint64_t>(static_cast<uint32_t>(cellX)) << 32)
+         | static_cast<uint32_t>(cellY);
+}
+
+// Call visit with the key of every cell overlapping the box
+template<class Visit>
+void SpatialIndex::forCells(float minX, float minY, float maxX, float maxY, Visit visit) const
+{
+  int lastX = cellOf(maxX);
+  int lastY = cellOf(maxY);
+  for (int cellX = cellOf(minX); cellX <= lastX; ++cellX)
+  {
+    for (int cellY = cellOf(minY); cellY <= lastY; ++cellY)
+    {
+      visit(cellKey(cellX, cellY));
+    }
+  }
+}
+
+// Index lines, with cells as large as their average length
+void SpatialIndex::build(const std::vector<Line *> & lines)
+{
+  m_cells.clear();
+
+  double totalLength = 0.0;
+  for (std::vector<Line *>::const_iterator it = lines.cbegin(); it != lines.cend(); ++it)
+  {
+    Coordinates begin = (*it)->getBeginPoint();
+    Coordinates end = (*it)->getEndPoint();
+    totalLength += hypot(end.x - begin.x, end.y - begin.y);
+  }
+  m_cellSize = DEFAULT_CELL_SIZE;
+  if (!lines.empty())
+  {
+    m_cellSize = std::max(MIN_CELL_SIZE, static_cast<float>(totalLength / lines.size()));
+  }
+
+  for (std::vector<Line *>::const_iterator it = lines.cbegin(); it != lines.cend(); ++it)
+  {
+    insert(*it);
+  }
+}
+
+void SpatialIndex::insert(Line * line)
+{
+  Coordinates begin = line->getBeginPoint();
+  Coordinates end = line->getEndPoint();
+  forCells(std::min(begin.x, end.x), std::min(begin.y, end.y),
+           std::max(begin.x, end.x), std::max(begin.y, end.y),
+           [&](uint64_t key)
+           {
+             m_cells[key].push_back(line);
+           });
+}
+
+// Remove a line, which must be where it was when inserted
+void SpatialIndex::remove(Line * line)
+{
+  Coordinates begin = line->getBeginPoint();
+  Coordinates end = line->getEndPoint();
+  forCells(std::min(begin.x, end.x), std::min(begin.y, end.y),
+           std::max(begin.x, end.x), std::max(begin.y, end.y),
+           [&](uint64_t key)
+           {
+             std::unordered_map<uint64_t, std::vector<Line *> >::iterator cell = m_cells.find(key);
+             if (cell == m_cells.end())
+             {
+               return;
+             }
+             std::vector<Line *> & cellLines = cell->second;
+             std::vector<Line *>::iterator it = std::find(cellLines.begin(), cellLines.end(), line);
+             if (it != cellLines.end())
+             {
+               *it = cellLines.back();
+               cellLines.pop_back();
+             }
+             if (cellLines.empty())
+             {
+               m_cells.erase(cell);
+             }
+           });
+}
+
+// The line nearest to a point, if any is within maxDistance, otherwise NULL
+Line * SpatialIndex::findNearestLine(float x, float y, float maxDistance) const
+{
+  Line * nearest = NULL;
+  float nearestDistance = maxDistance;
+  forCells(x - maxDistance, y - maxDistance, x + maxDistance, y + maxDistance,
+           [&](uint64_t key)
+           {
+             std::unordered_map<uint64_t, std::vector<Line *> >::const_iterator cell = m_cells.find(key);
+             if (cell == m_cells.end())
+             {
+               return;
+             }
+             for (std::vector<Line *>::const_iterator it = cell->second.cbegin();
+                 it != cell->second.cend(); ++it)
+             {
+               float distance = distanceToLine(*it, x, y);
+               if (distance <= nearestDistance)
+               {
+                 nearest = *it;
+                 nearestDistance = distance;
+               }
+             }
+           });
+  return nearest;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+class Line; // Forward declaration
+
+/*
+ * Uniform grid of lines, for finding the lines near a point
+ *
+ * Every line is listed in the cells its bounding box covers, in the x-y
+ * plane. With cells about as large as an average line, a lookup only looks
+ * at a handful of lines however large the network is. The grid does not
+ * follow lines by itself: a line must be removed before it is moved, and
+ * inserted again afterwards.
+ */
+class SpatialIndex
+{
+  private:
+    float m_cellSize;
+    std::unordered_map<uint64_t, std::vector<Line *> > m_cells;
+
+    int cellOf(float coordinate) const;
+    static uint64_t cellKey(int cellX, int cellY);
+    template<class Visit>
+    void forCells(float minX, float minY, float maxX, float maxY, Visit visit) const;
+
+  public:
+    SpatialIndex();
+
+    void build(const std::vector<Line *> & lines);
+    void insert(Line * line);
+    void remove(Line * line);
+
+    Line * findNearestLine(float x, float y, float maxDistance) const;
+};
+
+float distanceToLine(Line * line, float x, float y, float * fraction = NULL);
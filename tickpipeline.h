@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+/*
+ * Typed tick pipelines
+ *
+ * Users registered directly with the Controller are ticked through the
+ * virtual ControllerUser::tick(int), once per user and tick type. For large
+ * numbers of users of one concrete type, a TickPipeline stores them in a
+ * contiguous array and runs a compile time list of phases over them, each
+ * phase being a plain loop calling a non-virtual member function.
+ *
+ * Users are removed by swapping the last one into their place, so each
+ * User keeps its place in m_pipelineIndex, -1 when in no pipeline, and
+ * must be a friend of TickPipeline for that.
+ *
+ * Example:
+ *
+ *   typedef TickPipeline<Line,
+ *                        TickPhase<0, Line, &Line::tick0>,
+ *                        TickPhase<1, Line, &Line::tick1> > LinePipeline;
+ */
+
+class TickPipelineBase
+{
+  public:
+    virtual ~TickPipelineBase() {};
+    virtual void tick(int32_t tickType) = 0;
+};
+
+// One phase: call User::Method on all users during ticks of type TickType.
+template<int32_t TickType, class User, void (User::*Method)()>
+struct TickPhase
+{
+  static const int32_t TICK_TYPE = TickType;
+
+  static void run(User * user)
+  {
+    (user->*Method)();
+  }
+};
+
+template<class User, class... Phases>
+struct TickPhaseRunner;
+
+template<class User>
+struct TickPhaseRunner<User>
+{
+  static void run(int32_t, User * const *, size_t)
+  {
+  }
+};
+
+template<class User, class Phase, class... Rest>
+struct TickPhaseRunner<User, Phase, Rest...>
+{
+  static void run(int32_t tickType, User * const * users, size_t count)
+  {
+    if (Phase::TICK_TYPE == tickType)
+    {
+      for (size_t i = 0; i < count; ++i)
+      {
+        Phase::run(users[i]);
+      }
+    }
+    TickPhaseRunner<User, Rest...>::run(tickType, users, count);
+  }
+};
+
+template<class User, class... Phases>
+class TickPipeline : public TickPipelineBase
+{
+  private:
+    std::vector<User *> m_users;
+
+  public:
+    void add(User * user)
+    {
+      user->m_pipelineIndex = m_users.size();
+      m_users.push_back(user);
+    }
+
+    void remove(User * user)
+    {
+      int index = user->m_pipelineIndex;
+      if (index < 0 || index >= static_cast<int>(m_users.size()) || m_users[index] != user)
+      {
+        return;
+      }
+      m_users[index] = m_users.back();
+      m_users[index]->m_pipelineIndex = index;
+      m_users.pop_back();
+      user->m_pipelineIndex = -1;
+    }
+
+    const std::vector<User *> & users() const
+    {
+      return m_users;
+    }
+
+    virtual void tick(int32_t tickType)
+    {
+      TickPhaseRunner<User, Phases...>::run(tickType, m_users.data(), m_users.size());
+    }
+};
+
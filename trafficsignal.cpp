@@ -0,0 +1,129 @@
+#include "trafficsignal.h"
+#include "line.h"
+
+#include <algorithm>
+
+TrafficSignal::TrafficSignal(Controller * controller)
+  : ControllerUser(controller),
+    m_phaseIndex(controller, 0),
+    m_phaseTime(controller, 0)
+{
+}
+
+TrafficSignal::~TrafficSignal()
+{
+  controller->unregisterUser(this);
+}
+
+void TrafficSignal::addPhase(const SignalPhase & phase)
+{
+  m_phases.push_back(phase);
+
+  for (std::vector<Line *>::const_iterator lineIt = phase.greenLines.cbegin();
+      lineIt != phase.greenLines.cend(); ++lineIt)
+  {
+    if (std::find(m_lines.begin(), m_lines.end(), *lineIt) == m_lines.end())
+    {
+      m_lines.push_back(*lineIt);
+      (*lineIt)->setSignalled();
+    }
+  }
+}
+
+const std::vector<SignalPhase> & TrafficSignal::getPhases() const
+{
+  return m_phases;
+}
+
+void TrafficSignal::setPhaseTimes(int phaseIndex, int greenTime, int clearanceTime)
+{
+  m_phases[phaseIndex].greenTime = greenTime;
+  m_phases[phaseIndex].clearanceTime = clearanceTime;
+}
+
+const std::vector<Line *> & TrafficSignal::getLines() const
+{
+  return m_lines;
+}
+
+// Control replacement instead of line, or stop controlling line if
+// replacement is NULL, as when the network is edited.
+void TrafficSignal::replaceLine(Line * line, Line * replacement)
+{
+  std::vector<Line *>::iterator lineIt = std::find(m_lines.begin(), m_lines.end(), line);
+  if (lineIt == m_lines.end())
+  {
+    return;
+  }
+  m_lines.erase(lineIt);
+
+  for (std::vector<SignalPhase>::iterator phaseIt = m_phases.begin();
+      phaseIt != m_phases.end(); ++phaseIt)
+  {
+    std::vector<Line *> & greenLines = phaseIt->greenLines;
+    std::vector<Line *>::iterator it = std::find(greenLines.begin(), greenLines.end(), line);
+    if (it == greenLines.end())
+    {
+      continue;
+    }
+    if (replacement != NULL)
+    {
+      *it = replacement;
+    }
+    else
+    {
+      greenLines.erase(it);
+    }
+  }
+
+  if (replacement != NULL
+      && std::find(m_lines.begin(), m_lines.end(), replacement) == m_lines.end())
+  {
+    m_lines.push_back(replacement);
+    replacement->setSignalled();
+  }
+}
+
+int TrafficSignal::getPhaseIndex()
+{
+  return m_phaseIndex.NOW();
+}
+
+int TrafficSignal::getPhaseTime()
+{
+  return m_phaseTime.NOW();
+}
+
+void TrafficSignal::tick(int tickType)
+{
+  if (tickType != 0 || m_phases.empty())
+  {
+    return;
+  }
+
+  // Advance the phase
+  int phaseIndex = m_phaseIndex.NOW();
+  int phaseTime = m_phaseTime.NOW() + 1;
+  const SignalPhase * phase = &m_phases[phaseIndex];
+  if (phaseTime >= phase->greenTime + phase->clearanceTime)
+  {
+    phaseIndex = (phaseIndex + 1) % m_phases.size();
+    phaseTime = 0;
+    phase = &m_phases[phaseIndex];
+  }
+  m_phaseIndex.THEN() = phaseIndex;
+  m_phaseTime.THEN() = phaseTime;
+
+  // Set the lights. Every line must be set every tick,
+  // as the THEN value is otherwise two ticks old.
+  bool clearance = phaseTime >= phase->greenTime;
+  for (std::vector<Line *>::const_iterator lineIt = m_lines.cbegin();
+      lineIt != m_lines.cend(); ++lineIt)
+  {
+    bool green = !clearance
+      && std::find(phase->greenLines.begin(), phase->greenLines.end(), *lineIt)
+         != phase->greenLines.end();
+    (*lineIt)->setRed(!green);
+  }
+}
+
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "controller.h"
+#include "controlleruser.h"
+#include "lockstepvalue.h"
+
+#include <vector>
+
+class Line; // Forward declaration
+
+struct SignalPhase
+{
+  std::vector<Line *> greenLines;
+  int greenTime;     // Ticks
+  int clearanceTime; // Ticks of all red after the green time
+};
+
+/*
+ * Fixed time traffic signal
+ *
+ * Cycles through its phases, and every tick sets the red state of all the
+ * lines it controls. A line is green only during the green time of a phase
+ * listing it. Packets on a red line stop at its end without searching for
+ * interfering traffic, so a signalled intersection is cheaper to simulate
+ * than one regulated by yielding.
+ */
+class TrafficSignal : public ControllerUser
+{
+  private:
+    std::vector<SignalPhase> m_phases;
+    std::vector<Line *> m_lines; // All controlled lines
+    LockStepValue<int> m_phaseIndex;
+    LockStepValue<int> m_phaseTime;
+
+  public:
+    TrafficSignal(Controller * controller);
+    ~TrafficSignal();
+
+    void addPhase(const SignalPhase & phase);
+    const std::vector<SignalPhase> & getPhases() const;
+    void setPhaseTimes(int phaseIndex, int greenTime, int clearanceTime);
+    const std::vector<Line *> & getLines() const;
+    void replaceLine(Line * line, Line * replacement);
+    int getPhaseIndex();
+    int getPhaseTime();
+
+    virtual void tick(int tickType);
+};
+
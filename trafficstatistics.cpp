@@ -0,0 +1,118 @@
+#include "trafficstatistics.h"
+#include "line.h"
+
+const int SECONDS_PER_TICK = 1;
+const int SECONDS_PER_HOUR = 3600;
+
+float LoopDetector::getFlow() const
+{
+  if (ticks == 0)
+  {
+    return 0.0f;
+  }
+  return static_cast<float>(windowCount) * SECONDS_PER_HOUR / (ticks * SECONDS_PER_TICK);
+}
+
+float LoopDetector::getOccupancy() const
+{
+  if (ticks == 0)
+  {
+    return 0.0f;
+  }
+  return std::min(1.0f, static_cast<float>(windowOccupiedTime) / (static_cast<int64_t>(ticks) * OCCUPANCY_SCALE));
+}
+
+int LoopDetector::getSpeed() const
+{
+  if (windowCount == 0)
+  {
+    return 0;
+  }
+  return static_cast<int>(windowSpeedSum / windowCount);
+}
+
+TrafficStatistics::TrafficStatistics(Controller * controller)
+  : ControllerUser(controller)
+{
+}
+
+TrafficStatistics::~TrafficStatistics()
+{
+  controller->unregisterUser(this);
+
+  for (std::vector<LoopDetector *>::iterator it = m_detectors.begin(); it != m_detectors.end(); ++it)
+  {
+    (*it)->line->removeDetector(*it);
+    delete *it;
+  }
+}
+
+// Place a detector position mm from the beginning of line, averaging over window ticks
+LoopDetector * TrafficStatistics::addDetector(Line * line, int position, int window)
+{
+  LoopDetector * detector = new LoopDetector();
+  detector->line = line;
+  detector->position = std::max(0, std::min(position, line->getLength() - 1));
+  detector->tickCount = 0;
+  detector->tickSpeedSum = 0;
+  detector->tickOccupiedTime = 0;
+  detector->window = std::max(1, window);
+  detector->ticks = 0;
+  detector->next = 0;
+  detector->counts.assign(detector->window, 0);
+  detector->speedSums.assign(detector->window, 0);
+  detector->occupiedTimes.assign(detector->window, 0);
+  detector->windowCount = 0;
+  detector->windowSpeedSum = 0;
+  detector->windowOccupiedTime = 0;
+
+  line->addDetector(detector);
+  m_detectors.push_back(detector);
+  return detector;
+}
+
+void TrafficStatistics::removeDetector(LoopDetector * detector)
+{
+  std::vector<LoopDetector *>::iterator it = std::find(m_detectors.begin(), m_detectors.end(), detector);
+  if (it == m_detectors.end())
+  {
+    return;
+  }
+  *it = m_detectors.back();
+  m_detectors.pop_back();
+  detector->line->removeDetector(detector);
+  delete detector;
+}
+
+const std::vector<LoopDetector *> & TrafficStatistics::getDetectors() const
+{
+  return m_detectors;
+}
+
+void TrafficStatistics::tick(int tickType)
+{
+  if (tickType != 1)
+  {
+    return;
+  }
+
+  for (std::vector<LoopDetector *>::iterator it = m_detectors.begin(); it != m_detectors.end(); ++it)
+  {
+    LoopDetector & detector = **it;
+    int slot = detector.next;
+
+    // Drop the oldest tick once the window is full, then add this one
+    detector.windowCount += detector.tickCount - detector.counts[slot];
+    detector.windowSpeedSum += detector.tickSpeedSum - detector.speedSums[slot];
+    detector.windowOccupiedTime += detector.tickOccupiedTime - detector.occupiedTimes[slot];
+    detector.counts[slot] = detector.tickCount;
+    detector.speedSums[slot] = detector.tickSpeedSum;
+    detector.occupiedTimes[slot] = detector.tickOccupiedTime;
+
+    detector.next = slot + 1 < detector.window ? slot + 1 : 0;
+    detector.ticks = std::min(detector.ticks + 1, detector.window);
+    detector.tickCount = 0;
+    detector.tickSpeedSum = 0;
+    detector.tickOccupiedTime = 0;
+  }
+}
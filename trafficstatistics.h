@@ -0,0 +1,95 @@
+#pragma once
+
+#include "controller.h"
+#include "controlleruser.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+class Line; // Forward declaration
+
+const int DEFAULT_DETECTOR_WINDOW = 300; // Ticks
+const int OCCUPANCY_SCALE = 1000;        // Occupied time is counted in thousandths of a tick
+
+/*
+ * Virtual loop detector at a position on a line
+ *
+ * The line counts the packets whose fronts pass the detector, their speeds,
+ * and how long they cover it: in tick 0 for the packets moving along it,
+ * and in tick 1 for those coming in from other lines. Only the line writes
+ * these tick sums, so they need no locking however the lines are ticked.
+ * TrafficStatistics folds them into the sliding window once per tick, after
+ * the lines are done. Mesoscopic lines do not move their packets along, and
+ * do not count.
+ */
+struct LoopDetector
+{
+  Line * line;
+  int position; // mm from the beginning of the line
+
+  // This tick, written by the line
+  int tickCount;
+  int tickSpeedSum;    // mm/s
+  int tickOccupiedTime;
+
+  // Sliding window of per tick sums, written by TrafficStatistics
+  int window; // Ticks
+  int ticks;  // Ticks in the window so far, up to window
+  int next;   // Where the next tick goes in the circular buffers
+  std::vector<int> counts;
+  std::vector<int> speedSums;
+  std::vector<int> occupiedTimes;
+  int windowCount;
+  int64_t windowSpeedSum;
+  int64_t windowOccupiedTime;
+
+  // A packet's front moved from from to to this tick
+  void record(int from, int to, int length)
+  {
+    if (from < position && position <= to)
+    {
+      ++tickCount;
+      tickSpeedSum += to - from;
+    }
+    if (to > from)
+    {
+      int covered = std::min(to, position + length) - std::max(from, position);
+      if (covered > 0)
+      {
+        tickOccupiedTime += static_cast<int>(static_cast<int64_t>(covered) * OCCUPANCY_SCALE / (to - from));
+      }
+    }
+    else if (position <= from && from < position + length)
+    {
+      tickOccupiedTime += OCCUPANCY_SCALE;
+    }
+  }
+
+  float getFlow() const;      // Packets per hour
+  float getOccupancy() const; // Share of the time covered, 0 to 1
+  int getSpeed() const;       // Mean speed of the packets passing, mm/s
+};
+
+/*
+ * Online traffic statistics
+ *
+ * Owns the loop detectors, and moves their sliding windows along in tick 1,
+ * in time proportional to the number of detectors, not of packets. Lines
+ * without detectors pay one test per tick.
+ */
+class TrafficStatistics : public ControllerUser
+{
+  private:
+    std::vector<LoopDetector *> m_detectors;
+
+  public:
+    TrafficStatistics(Controller * controller);
+    ~TrafficStatistics();
+
+    LoopDetector * addDetector(Line * line, int position, int window = DEFAULT_DETECTOR_WINDOW);
+    void removeDetector(LoopDetector * detector);
+    const std::vector<LoopDetector *> & getDetectors() const;
+
+    virtual void tick(int tickType);
+};
@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "scenariorunner.h"
+
+struct BatchOptions
+{
+  int scenarios;
+  int seed;
+  int ticks;
+  int threads;
+  int warmup;
+  bool optimise;
+  std::vector<int> demands; // Percent, a set of scenarios for each
+  TrafficDemand mix;        // Class weights, in percent of the vehicles
+  std::vector<int> closedLines;
+};
+
+static void printUsage(const char * program)
+{
+  std::cerr << "Usage: " << program << " network.txt [name=value ...]" << std::endl
+            << "Options: scenarios, seed, ticks, threads, warmup, optimise, demand, buses, trucks,"
+            << " close" << std::endl;
+}
+
+// Set an option from name=value; false if it is not one
+static bool setOption(BatchOptions & options, const char * argument)
+{
+  const char * equals = strchr(argument, '=');
+  if (equals == NULL || equals[1] == '\0')
+  {
+    return false;
+  }
+  std::string name(argument, equals - argument);
+  char * end;
+  long value = strtol(equals + 1, &end, 10);
+  if (*end != '\0' || value < 0)
+  {
+    return false;
+  }
+
+  if (name == "scenarios")
+  {
+    options.scenarios = static_cast<int>(value);
+  }
+  else if (name == "seed")
+  {
+    options.seed = static_cast<int>(value);
+  }
+  else if (name == "ticks")
+  {
+    options.ticks = static_cast<int>(value);
+  }
+  else if (name == "threads")
+  {
+    options.threads = std::max(1, static_cast<int>(value));
+  }
+  else if (name == "warmup")
+  {
+    options.warmup = static_cast<int>(value);
+  }
+  else if (name == "optimise")
+  {
+    options.optimise = value != 0;
+  }
+  else if (name == "demand")
+  {
+    options.demands.push_back(static_cast<int>(value));
+  }
+  else if (name == "buses" || name == "trucks")
+  {
+    // The default weights add up to 100, so they are percents already
+    int * weights = options.mix.classWeights;
+    int vehicleClass = name == "buses" ? VEHICLE_CLASS_BUS : VEHICLE_CLASS_TRUCK;
+    int others = weights[VEHICLE_CLASS_BUS] + weights[VEHICLE_CLASS_TRUCK] - weights[vehicleClass];
+    if (value > 100 - others)
+    {
+      return false;
+    }
+    weights[vehicleClass] = static_cast<int>(value);
+    weights[VEHICLE_CLASS_CAR] = 100 - others - weights[vehicleClass];
+  }
+  else if (name == "close")
+  {
+    options.closedLines.push_back(static_cast<int>(value));
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Run a batch of scenarios of one network, one per thread at a time
+ *
+ * trafikkbatch network.txt [name=value ...]
+ *
+ * The network is loaded once. Scenario i is seeded with seed + i, and the
+ * report has a line per scenario and the trips of all of them. With a
+ * warmup, the scenarios branch off one simulation run that many ticks with
+ * seed. optimise=1 has the SignalOptimiser retime the signals in every
+ * scenario. close=n closes the n-th line of the file, from 0, in every
+ * scenario, and may be given more than once.
+ *
+ * demand=p starts the lines with p percent of the usual vehicles. Given
+ * more than once, the scenarios are run again for each demand, with the
+ * same seeds, but a warm-up has only one. buses=p and trucks=p make
+ * those classes p percent of the vehicles, and cars the rest.
+ */
+int main(int argc, char * argv[])
+{
+  if (argc < 2)
+  {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  BatchOptions options;
+  options.threads = std::max(1u, std::thread::hardware_concurrency());
+  options.scenarios = options.threads;
+  options.seed = 1;
+  options.ticks = 3600;
+  options.warmup = 0;
+  options.optimise = false;
+  for (int i = 2; i < argc; ++i)
+  {
+    if (!setOption(options, argv[i]))
+    {
+      std::cerr << "Unknown option " << argv[i] << std::endl;
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (options.demands.empty())
+  {
+    options.demands.push_back(options.mix.percent);
+  }
+  if (options.warmup > 0 && options.demands.size() > 1)
+  {
+    std::cerr << "A warm-up has only one demand" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  NetworkTopology topology;
+  if (!topology.loadFromFile(argv[1]))
+  {
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Scenario> scenarios;
+  for (std::vector<int>::const_iterator demandIt = options.demands.cbegin();
+      demandIt != options.demands.cend(); ++demandIt)
+  {
+    for (int i = 0; i < options.scenarios; ++i)
+    {
+      Scenario scenario;
+      std::ostringstream name;
+      name << "seed" << options.seed + i;
+      if (options.demands.size() > 1)
+      {
+        name << "-d" << *demandIt;
+      }
+      scenario.name = name.str();
+      scenario.seed = options.seed + i;
+      scenario.ticks = options.ticks;
+      scenario.demand = options.mix;
+      scenario.demand.percent = *demandIt;
+      scenario.closedLines = options.closedLines;
+      scenario.optimiseSignals = options.optimise;
+      scenarios.push_back(scenario);
+    }
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<ScenarioResult> results;
+  if (options.warmup > 0)
+  {
+    if (!runEnsemble(topology, options.seed, options.warmup, scenarios.front().demand, scenarios,
+                     options.threads, results))
+    {
+      return EXIT_FAILURE;
+    }
+  }
+  else
+  {
+    runScenarios(topology, scenarios, options.threads, results);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  writeReport(std::cout, scenarios, results);
+  std::cout << std::endl << topology.lines.size() << " lines, "
+            << scenarios.size() << " scenarios on " << options.threads << " threads in "
+            << seconds << " s" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,368 @@
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "controller.h"
+#include "line.h"
+#include "road.h"
+
+const int TIMED_ROUNDS = 20;
+
+// brakeLength() as it was, in floating point
+static int powBrakeLength(int speed, int brakeAcceleration)
+{
+  return pow(speed, 2) / (2 * brakeAcceleration);
+}
+
+/*
+ * Check the integer brakeLength() against the floating point expression it
+ * replaced, for every speed up to MAX_SPEED either way and every vehicle
+ * class, and time both over those speeds. Returns the number of speeds
+ * that differ, plus one if brakeLength() is not the faster.
+ */
+static int checkBrakeLength()
+{
+  int mismatches = 0;
+  for (int vehicleClass = 0; vehicleClass < NUMBER_OF_VEHICLE_CLASSES; ++vehicleClass)
+  {
+    int brakeAcceleration = VEHICLE_CLASSES[vehicleClass].brakeAcceleration;
+    BrakeDivider divider = VEHICLE_CLASSES[vehicleClass].brakeDivider;
+    for (int speed = -MAX_SPEED; speed <= MAX_SPEED; ++speed)
+    {
+      int expected = powBrakeLength(speed, brakeAcceleration);
+      if (brakeLength(speed, divider) != expected || brakeLength(speed, brakeAcceleration) != expected)
+      {
+        if (mismatches++ < 10)
+        {
+          std::cerr << "brakeLength(" << speed << ", " << brakeAcceleration << ") is "
+                    << brakeLength(speed, divider) << ", not " << expected << std::endl;
+        }
+      }
+    }
+  }
+
+  // The vehicle class is read through a volatile, so that neither loop can
+  // be folded at compile time, and each call takes the low bit of the one
+  // before, so that the calls are timed one after another, as the searches
+  // make them, rather than vectorised
+  volatile int timedClass = VEHICLE_CLASS_CAR;
+  const VehicleClass & vehicleClass = VEHICLE_CLASSES[timedClass];
+  long long sum = 0;
+  int length = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int round = 0; round < TIMED_ROUNDS; ++round)
+  {
+    for (int speed = 0; speed < MAX_SPEED; ++speed)
+    {
+      length = brakeLength(speed + (length & 1), vehicleClass.brakeDivider);
+      sum += length;
+    }
+  }
+  std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+  length = 0;
+  for (int round = 0; round < TIMED_ROUNDS; ++round)
+  {
+    for (int speed = 0; speed < MAX_SPEED; ++speed)
+    {
+      length = powBrakeLength(speed + (length & 1), vehicleClass.brakeAcceleration);
+      sum -= length;
+    }
+  }
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  double calls = static_cast<double>(TIMED_ROUNDS) * MAX_SPEED;
+  double integerTime = std::chrono::duration<double, std::nano>(middle - start).count() / calls;
+  double powTime = std::chrono::duration<double, std::nano>(end - middle).count() / calls;
+  std::cout << "brakeLength: " << NUMBER_OF_VEHICLE_CLASSES << " classes, speeds -"
+            << MAX_SPEED << " to " << MAX_SPEED << ", " << mismatches << " differ; "
+            << integerTime << " ns/call, pow " << powTime << " ns/call" << std::endl;
+  if (integerTime >= powTime)
+  {
+    std::cerr << "brakeLength is no faster than pow" << std::endl;
+  }
+  return mismatches + (sum != 0 ? 1 : 0) + (integerTime >= powTime ? 1 : 0);
+}
+
+/*
+ * Check the same-line kernel against the full forward search
+ *
+ * Runs the network, and before every tick decides the speed action of
+ * every packet behind another in the same line both ways: with
+ * followLeaderKernel() over the line's packets, and with
+ * forwardGetSpeedAction(). Packets the kernel leaves to the search are
+ * skipped. Returns the number of packets that got different actions.
+ */
+static int checkFollowLeaderKernel(const std::string & networkFileName, unsigned int seed,
+                                   int ticks, int & checked)
+{
+  seedRandom(seed);
+  Controller controller;
+  controller.registerTickType(0);
+  controller.registerTickType(LANE_CHANGE_TICK);
+  controller.registerTickType(1);
+  TransportNetwork transportNetwork(&controller);
+  if (!transportNetwork.loadLinesFromFile(networkFileName))
+  {
+    return 1;
+  }
+
+  int mismatches = 0;
+  std::vector<int> positions, speeds, lengths;
+  std::vector<unsigned char> vehicleClasses, actions, needsSearch;
+  for (int tick = 0; tick < ticks; ++tick)
+  {
+    const std::vector<Line *> & lines = transportNetwork.getLines();
+    for (std::vector<Line *>::const_iterator lineIt = lines.cbegin(); lineIt != lines.cend(); ++lineIt)
+    {
+      const std::vector<PacketId> & packets = (*lineIt)->getPackets();
+      int count = packets.size();
+      positions.resize(count);
+      speeds.resize(count);
+      lengths.resize(count);
+      vehicleClasses.resize(count);
+      actions.resize(count);
+      needsSearch.resize(count);
+      for (int i = 0; i < count; ++i)
+      {
+        TransportNetworkPacket * packet = transportNetwork.getPacket(packets[i]);
+        positions[i] = packet->mutableData.NOW().positionAtLine;
+        speeds[i] = packet->mutableData.NOW().speed;
+        lengths[i] = packet->length;
+        vehicleClasses[i] = packet->vehicleClass;
+      }
+      followLeaderKernel(positions.data(), speeds.data(), lengths.data(), vehicleClasses.data(),
+                         count, (*lineIt)->getLength(), actions.data(), needsSearch.data());
+
+      for (int i = 1; i < count; ++i)
+      {
+        if (needsSearch[i])
+        {
+          continue;
+        }
+        ++checked;
+        TransportNetworkPacket * packet = transportNetwork.getPacket(packets[i]);
+        SpeedActionInfo info = (*lineIt)->forwardGetSpeedAction(packet, i, *lineIt, positions[i]);
+        PacketId blockedBy = actions[i] == INCREASE ? NO_PACKET : packets[i - 1];
+        if (info.speedAction != actions[i] || info.blockedBy != blockedBy)
+        {
+          if (mismatches++ < 10)
+          {
+            std::cerr << networkFileName << ": tick " << tick << ", packet " << packets[i]
+                      << ": kernel " << static_cast<int>(actions[i])
+                      << ", search " << info.speedAction << std::endl;
+          }
+        }
+      }
+    }
+    controller.tick();
+  }
+  return mismatches;
+}
+
+/*
+ * Check turning lines mesoscopic and back in the middle of a run
+ *
+ * Every line with packets on it is made mesoscopic halfway through the
+ * run, and microscopic again a quarter of the run later. No packet may be
+ * lost either way, and the packets given back must stand front first on
+ * their line without overlapping. Returns the number of failed checks.
+ */
+static int checkMesoscopicConversion(const std::string & networkFileName, unsigned int seed, int ticks)
+{
+  seedRandom(seed);
+  Controller controller;
+  controller.registerTickType(0);
+  controller.registerTickType(LANE_CHANGE_TICK);
+  controller.registerTickType(1);
+  TransportNetwork transportNetwork(&controller);
+  if (!transportNetwork.loadLinesFromFile(networkFileName))
+  {
+    return 1;
+  }
+
+  int failures = 0;
+  std::vector<Line *> converted;
+  for (int tick = 0; tick < ticks; ++tick)
+  {
+    const std::vector<Line *> & lines = transportNetwork.getLines();
+    if (tick == ticks / 2)
+    {
+      for (std::vector<Line *>::const_iterator lineIt = lines.cbegin(); lineIt != lines.cend(); ++lineIt)
+      {
+        int packets = (*lineIt)->getNumberOfPackets();
+        if (packets > 0 && !(*lineIt)->isMesoscopic())
+        {
+          (*lineIt)->setMesoscopic(true);
+          converted.push_back(*lineIt);
+          if ((*lineIt)->getNumberOfPackets() != packets || !(*lineIt)->getPackets().empty())
+          {
+            ++failures;
+          }
+        }
+      }
+    }
+    else if (tick == (3 * ticks) / 4)
+    {
+      for (std::vector<Line *>::const_iterator lineIt = converted.cbegin(); lineIt != converted.cend(); ++lineIt)
+      {
+        int packets = (*lineIt)->getNumberOfPackets();
+        if (!(*lineIt)->setMesoscopic(false))
+        {
+          continue; // The queue does not fit; the line stays mesoscopic
+        }
+        const std::vector<PacketId> & packetIds = (*lineIt)->getPackets();
+        if (static_cast<int>(packetIds.size()) != packets)
+        {
+          ++failures;
+        }
+        int rear = (*lineIt)->getLength();
+        for (std::vector<PacketId>::const_iterator it = packetIds.cbegin(); it != packetIds.cend(); ++it)
+        {
+          TransportNetworkPacket * packet = transportNetwork.getPacket(*it);
+          int position = packet->mutableData.NOW().positionAtLine;
+          if (packet->mutableData.NOW().line != *lineIt || position >= rear || position - packet->length < 0)
+          {
+            ++failures;
+          }
+          rear = position - packet->length;
+        }
+      }
+    }
+
+    controller.tick();
+
+    int packets = 0;
+    for (std::vector<Line *>::const_iterator lineIt = lines.cbegin(); lineIt != lines.cend(); ++lineIt)
+    {
+      packets += (*lineIt)->getNumberOfPackets();
+    }
+    if (packets != transportNetwork.getNumberOfPackets())
+    {
+      if (failures++ < 10)
+      {
+        std::cerr << networkFileName << ": tick " << tick << ": " << packets << " packets on lines, "
+                  << transportNetwork.getNumberOfPackets() << " in the network" << std::endl;
+      }
+    }
+  }
+  return failures;
+}
+
+// Add a packet at position on line, for ticking onto it
+static PacketId placePacket(Controller & controller, TransportNetwork & transportNetwork,
+                            Line * line, int position)
+{
+  TransportNetworkPacket packet(&controller);
+  packet.vehicle = NULL;
+  packet.vehicleClass = VEHICLE_CLASS_CAR;
+  packet.length = VEHICLE_CLASSES[VEHICLE_CLASS_CAR].length;
+  packet.preferredSpeed = SPEED;
+
+  TransportNetworkPacketMutableData mutableData;
+  mutableData.speed = SPEED;
+  mutableData.positionAtLine = position;
+  mutableData.speedAction = MAINTAIN;
+  mutableData.waitingFor = NO_PACKET;
+  mutableData.waitedTime = 0;
+  mutableData.physicallyBlocked = false;
+  packet.mutableData.initialize(mutableData);
+  return transportNetwork.addPacket(packet, line);
+}
+
+/*
+ * Check what a line yielding to a mesoscopic line sees of it
+ *
+ * Two lines meet, and a packet near the end of the one yields to a packet
+ * approaching on the other. It must brake for it while the other line is
+ * microscopic. Once that line is mesoscopic, the yield search does not see
+ * its queue, as documented at Line::setMesoscopic(), and the packet must
+ * not be blocked by it. Made microscopic again, the queue stands at the end
+ * of the line and blocks the packet once more. Returns the number of
+ * failed checks.
+ */
+static int checkMesoscopicYield()
+{
+  Controller controller;
+  controller.registerTickType(0);
+  controller.registerTickType(LANE_CHANGE_TICK);
+  controller.registerTickType(1);
+  TransportNetwork transportNetwork(&controller);
+  Coordinates junction = {0.0f, 0.0f, 0.0f};
+  Coordinates west = {-100000.0f, 0.0f, 0.0f};
+  Coordinates south = {0.0f, -100000.0f, 0.0f};
+  Coordinates east = {100000.0f, 0.0f, 0.0f};
+  Line * yielding = transportNetwork.addLine(west, junction);
+  Line * priority = transportNetwork.addLine(south, junction);
+  Line * out = transportNetwork.addLine(junction, east);
+  transportNetwork.connectLines(yielding, out);
+  transportNetwork.connectLines(priority, out);
+  transportNetwork.setConflictRule(yielding, priority, YIELD_TO);
+
+  int position = yielding->getLength() - 2 * SPEED;
+  PacketId yieldingId = placePacket(controller, transportNetwork, yielding, position);
+  PacketId priorityId = placePacket(controller, transportNetwork, priority, priority->getLength() - 3 * SPEED);
+  controller.tick();
+
+  int failures = 0;
+  const char * stages[] = {"microscopic", "mesoscopic", "microscopic again"};
+  bool expectBlocked[] = {true, false, true};
+  for (int stage = 0; stage < 3; ++stage)
+  {
+    if (stage > 0 && !priority->setMesoscopic(stage == 1))
+    {
+      ++failures;
+    }
+    TransportNetworkPacket * packet = transportNetwork.getPacket(yieldingId);
+    SpeedActionInfo info = yielding->forwardGetSpeedAction(packet, 0, yielding,
+                                                           packet->mutableData.NOW().positionAtLine);
+    bool blocked = info.speedAction == BRAKE && info.blockedBy == priorityId;
+    if (blocked != expectBlocked[stage])
+    {
+      ++failures;
+      std::cerr << "Yield to a " << stages[stage] << " line: speed action " << info.speedAction
+                << ", blocked by " << info.blockedBy << std::endl;
+    }
+  }
+  return failures;
+}
+
+/*
+ * Consistency checks of the fast paths against the plain code they replace
+ *
+ * trafikkcheck network.txt [ticks]
+ *
+ * Exits with failure if any check fails.
+ */
+int main(int argc, char * argv[])
+{
+  if (argc < 2 || argc > 3)
+  {
+    std::cerr << "Usage: " << argv[0] << " network.txt [ticks]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int ticks = argc == 3 ? std::atoi(argv[2]) : 1000;
+
+  int failures = checkBrakeLength();
+
+  int checked = 0;
+  int kernelMismatches = 0;
+  for (unsigned int seed = 1; seed <= 3; ++seed)
+  {
+    kernelMismatches += checkFollowLeaderKernel(argv[1], seed, ticks, checked);
+  }
+  std::cout << "followLeaderKernel: " << checked << " packets checked, "
+            << kernelMismatches << " differ" << std::endl;
+  failures += kernelMismatches;
+
+  int mesoscopicFailures = checkMesoscopicYield();
+  for (unsigned int seed = 1; seed <= 3; ++seed)
+  {
+    mesoscopicFailures += checkMesoscopicConversion(argv[1], seed, ticks);
+  }
+  std::cout << "mesoscopic lines: " << mesoscopicFailures << " checks failed" << std::endl;
+  failures += mesoscopicFailures;
+
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <cstdlib>
+#include <string>
+
+#include "controller.h"
+#include "journal.h"
+#include "line.h"
+#include "road.h"
+
+/*
+ * Run a recorded simulation again, without drawing it
+ *
+ * trafikkreplay journal [tick]
+ *
+ * Replays the journal up to tick, by default to where the recording ended,
+ * and prints the state there. At the end of the recording, the state is
+ * checked against the one recorded, and a difference is an error.
+ */
+int main(int argc, char * argv[])
+{
+  if (argc < 2 || argc > 3)
+  {
+    std::cerr << "Usage: " << argv[0] << " journal [tick]" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Journal journal;
+  if (!journal.load(argv[1]))
+  {
+    return EXIT_FAILURE;
+  }
+  unsigned int target = journal.hasEnd ? journal.endTick
+                      : journal.entries.empty() ? 0 : journal.entries.back().tick;
+  if (argc == 3)
+  {
+    char * end;
+    long tick = strtol(argv[2], &end, 10);
+    if (*end != '\0' || tick < 0)
+    {
+      std::cerr << "Bad tick " << argv[2] << std::endl;
+      return EXIT_FAILURE;
+    }
+    target = static_cast<unsigned int>(tick);
+  }
+
+  seedRandom(journal.seed);
+  Controller controller;
+  controller.registerTickType(0);
+  controller.registerTickType(LANE_CHANGE_TICK);
+  controller.registerTickType(1);
+  TransportNetwork transportNetwork(&controller);
+  if (!transportNetwork.loadLinesFromFile(journal.networkFileName))
+  {
+    return EXIT_FAILURE;
+  }
+  JournalPlayer player(&controller, &transportNetwork, journal);
+  player.run(target);
+
+  uint64_t hash = transportNetwork.hashState();
+  std::cout << "Tick " << transportNetwork.getTick() << ", "
+            << transportNetwork.getNumberOfPackets() << " packets, state "
+            << hash << std::endl;
+  transportNetwork.getTripStatistics().writeSummary(std::cout);
+
+  if (journal.hasEnd && target == journal.endTick && hash != journal.endHash)
+  {
+    std::cerr << "State differs from the recording, which was " << journal.endHash << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,215 @@
+#include "tripstatistics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+QuantileSketch::QuantileSketch(double relativeAccuracy)
+{
+  m_gamma = (1.0 + relativeAccuracy) / (1.0 - relativeAccuracy);
+  m_logGamma = std::log(m_gamma);
+  clear();
+}
+
+int QuantileSketch::index(double value) const
+{
+  return static_cast<int>(std::ceil(std::log(value) / m_logGamma));
+}
+
+void QuantileSketch::addToBin(int binIndex, uint64_t count)
+{
+  if (m_bins.empty())
+  {
+    m_bins.push_back(0);
+    m_minIndex = binIndex;
+  }
+  else if (binIndex < m_minIndex)
+  {
+    m_bins.insert(m_bins.begin(), m_minIndex - binIndex, 0);
+    m_minIndex = binIndex;
+  }
+  else if (binIndex >= m_minIndex + static_cast<int>(m_bins.size()))
+  {
+    m_bins.resize(binIndex - m_minIndex + 1, 0);
+  }
+  m_bins[binIndex - m_minIndex] += count;
+}
+
+void QuantileSketch::add(double value)
+{
+  if (value > 0.0)
+  {
+    addToBin(index(value), 1);
+  }
+  else
+  {
+    ++m_zeroCount;
+  }
+  m_max = m_count == 0 ? value : std::max(m_max, value);
+  ++m_count;
+  m_sum += value;
+}
+
+// Add the values of other, which must have the same relative accuracy
+void QuantileSketch::merge(const QuantileSketch & other)
+{
+  if (other.m_count == 0)
+  {
+    return;
+  }
+  for (size_t i = 0; i < other.m_bins.size(); ++i)
+  {
+    if (other.m_bins[i] != 0)
+    {
+      addToBin(other.m_minIndex + static_cast<int>(i), other.m_bins[i]);
+    }
+  }
+  m_max = m_count == 0 ? other.m_max : std::max(m_max, other.m_max);
+  m_zeroCount += other.m_zeroCount;
+  m_count += other.m_count;
+  m_sum += other.m_sum;
+}
+
+void QuantileSketch::clear()
+{
+  m_bins.clear();
+  m_minIndex = 0;
+  m_zeroCount = 0;
+  m_count = 0;
+  m_sum = 0.0;
+  m_max = 0.0;
+}
+
+uint64_t QuantileSketch::getCount() const
+{
+  return m_count;
+}
+
+double QuantileSketch::getMean() const
+{
+  return m_count > 0 ? m_sum / m_count : 0.0;
+}
+
+double QuantileSketch::getMax() const
+{
+  return m_max;
+}
+
+double QuantileSketch::getQuantile(double quantile) const
+{
+  if (m_count == 0)
+  {
+    return 0.0;
+  }
+
+  uint64_t rank = static_cast<uint64_t>(std::max(0.0, std::min(quantile, 1.0)) * (m_count - 1));
+  if (rank < m_zeroCount)
+  {
+    return 0.0;
+  }
+
+  uint64_t seen = m_zeroCount;
+  for (size_t i = 0; i < m_bins.size(); ++i)
+  {
+    seen += m_bins[i];
+    if (seen > rank)
+    {
+      // The middle of the bin, relative to its bounds
+      double value = 2.0 * std::pow(m_gamma, m_minIndex + static_cast<int>(i)) / (m_gamma + 1.0);
+      return std::min(value, m_max);
+    }
+  }
+  return m_max;
+}
+
+void QuantileSketch::write(std::ostream & out) const
+{
+  std::streamsize precision = out.precision(17);
+  out << m_count << " " << m_zeroCount << " " << m_sum << " " << m_max << " "
+      << m_minIndex << " " << m_bins.size();
+  for (std::vector<uint64_t>::const_iterator it = m_bins.cbegin(); it != m_bins.cend(); ++it)
+  {
+    out << " " << *it;
+  }
+  out << std::endl;
+  out.precision(precision);
+}
+
+bool QuantileSketch::read(std::istream & in)
+{
+  size_t binCount;
+  if (!(in >> m_count >> m_zeroCount >> m_sum >> m_max >> m_minIndex >> binCount))
+  {
+    clear();
+    return false;
+  }
+  m_bins.resize(binCount);
+  for (size_t i = 0; i < binCount; ++i)
+  {
+    if (!(in >> m_bins[i]))
+    {
+      clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+void TripStatistics::add(int tripTime, int delay, int stops)
+{
+  this->tripTime.add(tripTime);
+  this->delay.add(static_cast<double>(delay) / MILLISECONDS_PER_TICK);
+  this->stops.add(stops);
+}
+
+void TripStatistics::merge(const TripStatistics & other)
+{
+  tripTime.merge(other.tripTime);
+  delay.merge(other.delay);
+  stops.merge(other.stops);
+}
+
+void TripStatistics::clear()
+{
+  tripTime.clear();
+  delay.clear();
+  stops.clear();
+}
+
+uint64_t TripStatistics::getTrips() const
+{
+  return tripTime.getCount();
+}
+
+void TripStatistics::write(std::ostream & out) const
+{
+  tripTime.write(out);
+  delay.write(out);
+  stops.write(out);
+}
+
+bool TripStatistics::read(std::istream & in)
+{
+  return tripTime.read(in) && delay.read(in) && stops.read(in);
+}
+
+static void writeSketch(std::ostream & out, const char * name, const QuantileSketch & sketch)
+{
+  char line[160];
+  snprintf(line, sizeof(line), "%-14s mean %8.1f  p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f",
+      name, sketch.getMean(), sketch.getQuantile(0.5), sketch.getQuantile(0.9),
+      sketch.getQuantile(0.99), sketch.getMax());
+  out << line << std::endl;
+}
+
+void TripStatistics::writeSummary(std::ostream & out) const
+{
+  out << "Completed trips: " << getTrips() << std::endl;
+  if (getTrips() == 0)
+  {
+    return;
+  }
+  writeSketch(out, "Trip time (s)", tripTime);
+  writeSketch(out, "Delay (s)", delay);
+  writeSketch(out, "Stops", stops);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+const double SKETCH_RELATIVE_ACCURACY = 0.01;
+const int MILLISECONDS_PER_TICK = 1000;
+
+/*
+ * Quantile sketch with relative error guarantees (DDSketch)
+ *
+ * Positive values are counted in logarithmic bins, bin i holding those in
+ * (gamma^(i-1), gamma^i], so every quantile is within the relative accuracy
+ * of the true value. Values of zero or less share one bin. Memory grows
+ * with the logarithm of the range of the values, not with their number,
+ * and two sketches of the same accuracy merge exactly by adding their bins.
+ */
+class QuantileSketch
+{
+  private:
+    double m_gamma;
+    double m_logGamma;
+    std::vector<uint64_t> m_bins;
+    int m_minIndex; // Index of m_bins[0]
+    uint64_t m_zeroCount;
+    uint64_t m_count;
+    double m_sum;
+    double m_max;
+
+    int index(double value) const;
+    void addToBin(int binIndex, uint64_t count);
+
+  public:
+    QuantileSketch(double relativeAccuracy = SKETCH_RELATIVE_ACCURACY);
+
+    void add(double value);
+    void merge(const QuantileSketch & other);
+    void clear();
+
+    uint64_t getCount() const;
+    double getMean() const;
+    double getMax() const;
+    double getQuantile(double quantile) const; // quantile from 0 to 1
+
+    // As text, to be read back into a sketch of the same accuracy
+    void write(std::ostream & out) const;
+    bool read(std::istream & in);
+};
+
+/*
+ * Network wide distributions of completed trips
+ *
+ * A trip is completed when its packet leaves the network through a sink
+ * line. Packets dropped on the way, or taken out by editing, are not
+ * counted.
+ */
+struct TripStatistics
+{
+  QuantileSketch tripTime; // s
+  QuantileSketch delay;    // s behind free flow
+  QuantileSketch stops;
+
+  void add(int tripTime, int delay, int stops); // delay in ms
+  void merge(const TripStatistics & other);
+  void clear();
+  uint64_t getTrips() const;
+  void writeSummary(std::ostream & out) const;
+  void write(std::ostream & out) const;
+  bool read(std::istream & in);
+};